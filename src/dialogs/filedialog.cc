@@ -48,7 +48,7 @@ static key_t nul = 0;
 struct file_dialog_t::implementation_t {
   file_list_t names;
   std::unique_ptr<filtered_file_list_base_t> view;
-  std::string current_dir, lang_codeset_filter;
+  std::string current_dir, filter, lang_codeset_filter;
 
   int name_offset;
 
@@ -276,8 +276,9 @@ void file_dialog_t::change_dir(const std::string &dir) {
 
   impl->names = new_names;
   impl->current_dir = new_dir;
+  impl->filter = get_filter();
   impl->view->set_filter(
-      bind_front(glob_filter, &get_filter(), impl->show_hidden_box->get_state()));
+      bind_front(glob_filter, &impl->filter, impl->show_hidden_box->get_state()));
   impl->file_pane->reset();
 }
 
@@ -342,7 +343,7 @@ open_file_dialog_t::open_file_dialog_t(int height, int width)
 
 open_file_dialog_t::~open_file_dialog_t() {}
 
-const std::string &open_file_dialog_t::get_filter() const { return impl->filter_line->get_text(); }
+std::string open_file_dialog_t::get_filter() const { return impl->filter_line->get_text(); }
 
 bool open_file_dialog_t::set_size(optint height, optint width) {
   bool result = file_dialog_t::set_size(height, width);
@@ -35,7 +35,7 @@ class T3_WIDGET_API file_dialog_t : public dialog_t {
   const widget_t *get_insert_before_widget() const;
   void ok_callback();
   void ok_callback(const std::string &file);
-  virtual const std::string &get_filter() const = 0;
+  virtual std::string get_filter() const = 0;
 
  public:
   ~file_dialog_t() override;
@@ -58,7 +58,7 @@ class T3_WIDGET_API open_file_dialog_t : public file_dialog_t {
   struct T3_WIDGET_LOCAL implementation_t;
   single_alloc_pimpl_t<implementation_t> impl;
 
-  const std::string &get_filter() const override;
+  std::string get_filter() const override;
 
  public:
   open_file_dialog_t(int height, int width);
@@ -75,7 +75,7 @@ class T3_WIDGET_API save_as_dialog_t : public file_dialog_t {
   single_alloc_pimpl_t<implementation_t> impl;
 
  protected:
-  const std::string &get_filter() const override { return empty_filter; }
+  std::string get_filter() const override { return empty_filter; }
 
  public:
   save_as_dialog_t(int height, int width);
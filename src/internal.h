@@ -19,7 +19,9 @@
 #endif
 
 #include <algorithm>
+#include <cstdint>
 #include <memory>
+#include <mutex>
 #include <string>
 
 #ifdef HAS_SELECT_H
@@ -50,6 +52,24 @@ T3_WIDGET_LOCAL extern bool disable_primary_selection;
 
 T3_WIDGET_LOCAL void stop_clipboard();
 
+/** Lock held by line_tree_t while it releases its nodes. A text_snapshot_t shares nodes and line
+    storage with its text_buffer_t, and may be destroyed on any thread. Reading
+    std::shared_ptr::use_count does not order the reads made through the released references before
+    the modifications made after it, but taking this lock does. Use is_only_reference instead of
+    checking use_count directly. */
+T3_WIDGET_LOCAL extern std::mutex shared_release_lock;
+
+/** Returns whether @p ptr holds the only reference to its object, such that the object may be
+    modified in place. */
+template <typename T>
+bool is_only_reference(const std::shared_ptr<T> &ptr) {
+  if (ptr.use_count() != 1) {
+    return false;
+  }
+  std::lock_guard<std::mutex> guard(shared_release_lock);
+  return true;
+}
+
 #ifdef _T3_WIDGET_DEBUG
 #define ASSERT(_x)                                                                            \
   do {                                                                                        \
@@ -133,8 +153,24 @@ T3_WIDGET_LOCAL bool check_mouse_fd(fd_set *readset);
 
 enum { CLASS_WHITESPACE, CLASS_ALNUM, CLASS_GRAPH, CLASS_OTHER };
 
+/* Bits of the value returned by get_char_info. */
+enum {
+  /* Screen width of the character, as returned by text_line_t::key_width. */
+  CHAR_INFO_WIDTH_MASK = 0x03,
+  /* Character class (one of the CLASS_* values). */
+  CHAR_INFO_CLASS_MASK = 0x0c,
+  CHAR_INFO_CLASS_SHIFT = 2,
+  /* Set for characters in the general categories of T3_UTF8_CONTROL_MASK. */
+  CHAR_INFO_CONTROL = 0x10,
+};
+
+/** Get the width, character class and control status of code point @p c in a single lookup. */
+T3_WIDGET_LOCAL uint8_t get_char_info(uint32_t c);
 /** Get the character class associated with the character at a specific position in a string. */
-T3_WIDGET_LOCAL int get_class(const std::string &str, text_pos_t pos);
+T3_WIDGET_LOCAL int get_class(string_view str, text_pos_t pos);
+/* Check whether the bytes in line would remain unchanged when creating a text_line_t from them,
+   i.e. they are valid UTF-8. */
+T3_WIDGET_LOCAL bool is_round_trip_utf8(string_view line);
 
 template <typename C>
 void remove_element(C &container, typename C::value_type value) {
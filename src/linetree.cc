@@ -0,0 +1,397 @@
+/* Copyright (C) 2018 G.P. Halkes
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License version 3, as
+   published by the Free Software Foundation.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include "t3widget/linetree.h"
+
+#include <algorithm>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+#include "t3widget/internal.h"
+#include "t3widget/textline.h"
+#include "t3widget/util.h"
+
+namespace t3widget {
+
+/* Maximum number of lines stored in a single leaf. */
+static const size_t max_leaf_lines = 256;
+/* Maximum number of children of an internal node. */
+static const size_t max_children = 64;
+
+struct line_tree_t::node_t {
+  /* The number of lines stored in the sub-tree rooted at this node. */
+  size_t size;
+  /* The number of bytes stored in the sub-tree rooted at this node, counting one extra byte per
+     line for the line separator. Only valid if bytes_valid is true. */
+  mutable size_t bytes;
+  mutable bool bytes_valid;
+  bool leaf;
+  node_list_t children;  // Only used for internal nodes.
+  line_list_t lines;     // Only used for leaves.
+
+  explicit node_t(bool _leaf) : size(0), bytes(0), bytes_valid(false), leaf(_leaf) {}
+
+  size_t item_count() const { return leaf ? lines.size() : children.size(); }
+  size_t max_items() const { return leaf ? max_leaf_lines : max_children; }
+};
+
+line_tree_t::line_tree_t() : root(new node_t(true)) {}
+
+line_tree_t::line_tree_t(const line_tree_t &other) : root(other.root) {}
+
+std::mutex shared_release_lock;
+
+line_tree_t::~line_tree_t() {
+  std::lock_guard<std::mutex> guard(shared_release_lock);
+  root.reset();
+}
+
+size_t line_tree_t::size() const { return root->size; }
+
+/* Ensure that the node pointed to by node is not shared with other trees, by replacing it with a
+   copy if necessary. Returns the (possibly new) node. */
+line_tree_t::node_t *line_tree_t::make_private(node_ptr_t *node) {
+  if (!is_only_reference(*node)) {
+    const node_t *shared = node->get();
+    node_ptr_t copy(new node_t(shared->leaf));
+    copy->size = shared->size;
+    copy->bytes = shared->bytes;
+    copy->bytes_valid = shared->bytes_valid;
+    if (shared->leaf) {
+      copy->lines.reserve(shared->lines.size());
+      for (const line_ptr_t &line : shared->lines) {
+        copy->lines.push_back(line->clone(0, -1));
+      }
+    } else {
+      copy->children = shared->children;
+    }
+    *node = std::move(copy);
+  }
+  return node->get();
+}
+
+const line_tree_t::node_t *line_tree_t::find_leaf(const node_t *node, size_t *idx) {
+  while (!node->leaf) {
+    size_t child_idx = 0;
+    while (*idx >= node->children[child_idx]->size) {
+      *idx -= node->children[child_idx]->size;
+      ++child_idx;
+    }
+    node = node->children[child_idx].get();
+  }
+  return node;
+}
+
+/* Find the leaf containing the line at *idx, making all nodes on the path private. As the caller
+   may modify the line, the byte counts of these nodes are invalidated. */
+line_tree_t::node_t *line_tree_t::find_mutable_leaf(node_ptr_t *node_ptr, size_t *idx) {
+  node_t *node = make_private(node_ptr);
+  while (!node->leaf) {
+    node->bytes_valid = false;
+    size_t child_idx = 0;
+    while (*idx >= node->children[child_idx]->size) {
+      *idx -= node->children[child_idx]->size;
+      ++child_idx;
+    }
+    node = make_private(&node->children[child_idx]);
+  }
+  node->bytes_valid = false;
+  return node;
+}
+
+line_tree_t::line_ptr_t &line_tree_t::operator[](size_t idx) {
+  node_t *leaf = find_mutable_leaf(&root, &idx);
+  return leaf->lines[idx];
+}
+
+const line_tree_t::line_ptr_t &line_tree_t::operator[](size_t idx) const {
+  const node_t *leaf = find_leaf(root.get(), &idx);
+  return leaf->lines[idx];
+}
+
+size_t line_tree_t::node_bytes(const node_t *node) {
+  if (!node->bytes_valid) {
+    node->bytes = 0;
+    if (node->leaf) {
+      for (const line_ptr_t &line : node->lines) {
+        node->bytes += line->size() + 1;
+      }
+    } else {
+      for (const node_ptr_t &child : node->children) {
+        node->bytes += node_bytes(child.get());
+      }
+    }
+    node->bytes_valid = true;
+  }
+  return node->bytes;
+}
+
+size_t line_tree_t::bytes_before(size_t idx) const {
+  ASSERT(idx <= size());
+  const node_t *node = root.get();
+  size_t result = 0;
+
+  while (!node->leaf) {
+    size_t child_idx = 0;
+    while (child_idx + 1 < node->children.size() && idx >= node->children[child_idx]->size) {
+      idx -= node->children[child_idx]->size;
+      result += node_bytes(node->children[child_idx].get());
+      ++child_idx;
+    }
+    node = node->children[child_idx].get();
+  }
+  for (size_t i = 0; i < idx; ++i) {
+    result += node->lines[i]->size() + 1;
+  }
+  return result;
+}
+
+size_t line_tree_t::total_bytes() const { return node_bytes(root.get()); }
+
+size_t line_tree_t::find_byte_offset(size_t *offset) const {
+  const node_t *node = root.get();
+  size_t idx = 0;
+
+  if (*offset >= node_bytes(node)) {
+    *offset -= node_bytes(node);
+    return size();
+  }
+
+  while (!node->leaf) {
+    size_t child_idx = 0;
+    while (*offset >= node_bytes(node->children[child_idx].get())) {
+      *offset -= node_bytes(node->children[child_idx].get());
+      idx += node->children[child_idx]->size;
+      ++child_idx;
+    }
+    node = node->children[child_idx].get();
+  }
+  for (const line_ptr_t &line : node->lines) {
+    const size_t line_bytes = line->size() + 1;
+    if (*offset < line_bytes) {
+      break;
+    }
+    *offset -= line_bytes;
+    ++idx;
+  }
+  return idx;
+}
+
+void line_tree_t::push_back(line_ptr_t line) { insert(size(), std::move(line)); }
+
+void line_tree_t::insert(size_t idx, line_ptr_t line) {
+  line_list_t single;
+  single.push_back(std::move(line));
+  insert_at_root(idx, single.begin(), single.end());
+}
+
+void line_tree_t::insert(size_t idx, std::vector<line_ptr_t> lines) {
+  if (lines.empty()) {
+    return;
+  }
+  insert_at_root(idx, lines.begin(), lines.end());
+}
+
+void line_tree_t::insert(size_t idx, std::vector<line_ptr_t>::iterator first,
+                         std::vector<line_ptr_t>::iterator last) {
+  if (first == last) {
+    return;
+  }
+  insert_at_root(idx, first, last);
+}
+
+void line_tree_t::erase(size_t first, size_t last) {
+  if (first >= last) {
+    return;
+  }
+  ASSERT(last <= size());
+
+  erase_lines(make_private(&root), first, last);
+  /* Remove levels from the tree that no longer serve any purpose. */
+  while (!root->leaf && root->children.size() <= 1) {
+    if (root->children.empty()) {
+      root.reset(new node_t(true));
+    } else {
+      root = std::move(root->children.front());
+    }
+  }
+}
+
+/* Split a node which holds more items than allowed into as many nodes as necessary. The first
+   part remains in node, the remaining parts are appended to overflow. */
+void line_tree_t::split_node(node_t *node, node_list_t *overflow) {
+  const size_t count = node->item_count();
+  const size_t max = node->max_items();
+
+  if (count <= max) {
+    return;
+  }
+
+  const size_t parts = (count + max - 1) / max;
+  node->bytes_valid = false;
+  for (size_t part = 1; part < parts; ++part) {
+    const size_t begin = count * part / parts;
+    const size_t end = count * (part + 1) / parts;
+    node_ptr_t sibling(new node_t(node->leaf));
+    if (node->leaf) {
+      sibling->lines.assign(std::make_move_iterator(node->lines.begin() + begin),
+                            std::make_move_iterator(node->lines.begin() + end));
+      sibling->size = sibling->lines.size();
+    } else {
+      sibling->children.assign(std::make_move_iterator(node->children.begin() + begin),
+                               std::make_move_iterator(node->children.begin() + end));
+      for (const node_ptr_t &child : sibling->children) {
+        sibling->size += child->size;
+      }
+    }
+    node->size -= sibling->size;
+    overflow->push_back(std::move(sibling));
+  }
+
+  if (node->leaf) {
+    node->lines.resize(count / parts);
+  } else {
+    node->children.resize(count / parts);
+  }
+}
+
+/* Merge the child at child_idx with one of its siblings if it has become too small. If the merged
+   node is too large, it is split again, which redistributes the items over the two nodes. */
+void line_tree_t::fix_underflow(node_t *node, size_t child_idx) {
+  if (node->children.size() < 2) {
+    return;
+  }
+  {
+    const node_t *child = node->children[child_idx].get();
+    if (child->item_count() >= child->max_items() / 4) {
+      return;
+    }
+  }
+
+  const size_t left_idx = child_idx + 1 < node->children.size() ? child_idx : child_idx - 1;
+  node_t *left = make_private(&node->children[left_idx]);
+  make_private(&node->children[left_idx + 1]);
+  node_ptr_t right = std::move(node->children[left_idx + 1]);
+  node->children.erase(node->children.begin() + left_idx + 1);
+
+  left->size += right->size;
+  left->bytes_valid = false;
+  if (left->leaf) {
+    left->lines.insert(left->lines.end(), std::make_move_iterator(right->lines.begin()),
+                       std::make_move_iterator(right->lines.end()));
+  } else {
+    left->children.insert(left->children.end(), std::make_move_iterator(right->children.begin()),
+                          std::make_move_iterator(right->children.end()));
+  }
+
+  node_list_t overflow;
+  split_node(left, &overflow);
+  node->children.insert(node->children.begin() + left_idx + 1,
+                        std::make_move_iterator(overflow.begin()),
+                        std::make_move_iterator(overflow.end()));
+}
+
+void line_tree_t::insert_lines(node_t *node, size_t idx, line_list_t::iterator first,
+                               line_list_t::iterator last, node_list_t *overflow) {
+  node->size += last - first;
+  node->bytes_valid = false;
+  if (node->leaf) {
+    node->lines.insert(node->lines.begin() + idx, std::make_move_iterator(first),
+                       std::make_move_iterator(last));
+  } else {
+    /* Find the child to insert into. When inserting exactly at the boundary between two children,
+       the lines are appended to the first. */
+    size_t child_idx = 0;
+    while (child_idx + 1 < node->children.size() && idx > node->children[child_idx]->size) {
+      idx -= node->children[child_idx]->size;
+      ++child_idx;
+    }
+
+    node_list_t child_overflow;
+    insert_lines(make_private(&node->children[child_idx]), idx, first, last, &child_overflow);
+    node->children.insert(node->children.begin() + child_idx + 1,
+                          std::make_move_iterator(child_overflow.begin()),
+                          std::make_move_iterator(child_overflow.end()));
+  }
+  split_node(node, overflow);
+}
+
+void line_tree_t::insert_at_root(size_t idx, line_list_t::iterator first,
+                                 line_list_t::iterator last) {
+  ASSERT(idx <= size());
+
+  node_list_t overflow;
+  insert_lines(make_private(&root), idx, first, last, &overflow);
+  /* If the root was split, add a new level to the tree. */
+  while (!overflow.empty()) {
+    node_ptr_t new_root(new node_t(false));
+    new_root->size = root->size;
+    new_root->children.push_back(std::move(root));
+    for (node_ptr_t &node : overflow) {
+      new_root->size += node->size;
+      new_root->children.push_back(std::move(node));
+    }
+    overflow.clear();
+    root = std::move(new_root);
+    split_node(root.get(), &overflow);
+  }
+}
+
+void line_tree_t::erase_lines(node_t *node, size_t first, size_t last) {
+  node->size -= last - first;
+  node->bytes_valid = false;
+  if (node->leaf) {
+    node->lines.erase(node->lines.begin() + first, node->lines.begin() + last);
+    return;
+  }
+
+  size_t child_idx = 0;
+  size_t offset = 0;
+  while (offset + node->children[child_idx]->size <= first) {
+    offset += node->children[child_idx]->size;
+    ++child_idx;
+  }
+
+  const size_t first_affected = child_idx;
+  for (; child_idx < node->children.size() && offset < last; ++child_idx) {
+    const node_t *child = node->children[child_idx].get();
+    const size_t child_size = child->size;
+    const size_t child_first = first > offset ? first - offset : 0;
+    const size_t child_last = std::min(last - offset, child_size);
+
+    if (child_first == 0 && child_last == child_size) {
+      node->children[child_idx].reset();
+    } else {
+      erase_lines(make_private(&node->children[child_idx]), child_first, child_last);
+    }
+    offset += child_size;
+  }
+
+  /* Remove the children that were erased completely. */
+  node->children.erase(std::remove(node->children.begin() + first_affected,
+                                   node->children.begin() + child_idx, nullptr),
+                       node->children.begin() + child_idx);
+
+  /* At most two partially erased children remain, which are now adjacent. */
+  if (first_affected + 1 < node->children.size()) {
+    fix_underflow(node, first_affected + 1);
+  }
+  if (first_affected < node->children.size()) {
+    fix_underflow(node, first_affected);
+  }
+}
+
+}  // namespace t3widget
@@ -0,0 +1,115 @@
+/* Copyright (C) 2018 G.P. Halkes
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License version 3, as
+   published by the Free Software Foundation.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef T3_WIDGET_LINETREE_H
+#define T3_WIDGET_LINETREE_H
+
+#ifndef _T3_WIDGET_INTERNAL
+#error This header file is for internal use _only_!!
+#endif
+
+#include <cstddef>
+#include <memory>
+#include <t3widget/textline.h>
+#include <t3widget/util.h>
+#include <t3widget/widget_api.h>
+#include <vector>
+
+namespace t3widget {
+
+/** Container holding the lines of a text_buffer_t.
+
+    The lines are stored in the leaves of a B+-tree, in which each node keeps the number of lines
+    stored in its sub-tree. This makes looking up a line by index, as well as inserting and erasing
+    lines, O(log n) operations. The interface mimics the subset of the std::vector interface that
+    is used by text_buffer_t, except that positions are passed as indices instead of iterators.
+
+    The nodes also keep the number of bytes stored in their sub-tree, counting one extra byte per
+    line for the line separator, to allow conversion between line indices and byte offsets. These
+    counts are computed lazily. As lines may be modified through the reference returned by the
+    non-const operator[], that operator invalidates the counts of the nodes on the path to the
+    line. Lines must therefore not be modified through references or pointers that were obtained
+    before a call to one of the byte offset functions.
+
+    Copying a line_tree_t is an O(1) operation: the nodes are shared between the copies. Any
+    non-const operation first copies the shared nodes on the path it modifies, where copying a
+    leaf also copies its lines (using text_line_t::clone). Because the const operations don't
+    modify shared lines or nodes (other than the byte counts), a copy can be read from another
+    thread while the original is modified, as long as only the const operator[] and size are used
+    on the copy. The copy may also be destroyed on that thread (see shared_release_lock).
+*/
+class T3_WIDGET_LOCAL line_tree_t {
+ public:
+  using line_ptr_t = std::unique_ptr<text_line_t>;
+
+  line_tree_t();
+  line_tree_t(const line_tree_t &other);
+  ~line_tree_t();
+
+  line_tree_t &operator=(const line_tree_t &other) = delete;
+
+  size_t size() const;
+  bool empty() const { return size() == 0; }
+
+  line_ptr_t &operator[](size_t idx);
+  const line_ptr_t &operator[](size_t idx) const;
+  /** Const access through a non-const line_tree_t, for reading a line without invalidating the
+      byte counts or copying shared nodes. */
+  const line_ptr_t &at(size_t idx) const { return (*this)[idx]; }
+
+  void push_back(line_ptr_t line);
+  /** Insert a single line, such that it will be at index @p idx. */
+  void insert(size_t idx, line_ptr_t line);
+  /** Insert all lines in @p lines, such that the first will be at index @p idx.
+
+      The lines are spliced into the tree in a single operation, which is much cheaper than
+      inserting them one by one. */
+  void insert(size_t idx, std::vector<line_ptr_t> lines);
+  /** Insert the lines in [@p first, @p last), moving them out of the range. */
+  void insert(size_t idx, std::vector<line_ptr_t>::iterator first,
+              std::vector<line_ptr_t>::iterator last);
+  /** Erase the lines with indices [@p first, @p last). */
+  void erase(size_t first, size_t last);
+
+  /** Returns the number of bytes in the lines before index @p idx, including one per line for the
+      line separator. */
+  size_t bytes_before(size_t idx) const;
+  /** Returns the total number of bytes in all lines, including one per line for the separator. */
+  size_t total_bytes() const;
+  /** Find the line containing the byte at @p offset, counting bytes like bytes_before.
+      @param offset The offset to look for. On return, it contains the offset within the line.
+      @return The index of the line, or size() if @p offset lies beyond the last line. */
+  size_t find_byte_offset(size_t *offset) const;
+
+ private:
+  struct node_t;
+  using node_ptr_t = std::shared_ptr<node_t>;
+  using node_list_t = std::vector<node_ptr_t>;
+  using line_list_t = std::vector<line_ptr_t>;
+
+  node_ptr_t root;
+
+  static const node_t *find_leaf(const node_t *node, size_t *idx);
+  static node_t *find_mutable_leaf(node_ptr_t *node, size_t *idx);
+  static node_t *make_private(node_ptr_t *node);
+  static size_t node_bytes(const node_t *node);
+  static void insert_lines(node_t *node, size_t idx, line_list_t::iterator first,
+                           line_list_t::iterator last, node_list_t *overflow);
+  static void erase_lines(node_t *node, size_t first, size_t last);
+  static void split_node(node_t *node, node_list_t *overflow);
+  static void fix_underflow(node_t *node, size_t child_idx);
+  void insert_at_root(size_t idx, line_list_t::iterator first, line_list_t::iterator last);
+};
+
+}  // namespace t3widget
+#endif
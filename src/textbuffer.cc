@@ -12,14 +12,27 @@
    along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 #include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <cstdlib>
 #include <cstring>
+#include <fcntl.h>
 #include <limits>
 #include <memory>
 #include <string>
+#include <sys/stat.h>
+#include <sys/types.h>
 #include <t3window/window.h>
 #include <type_traits>
+#include <unistd.h>
 #include <utility>
 #include <vector>
+#ifdef HAS_MMAP
+#include <sys/mman.h>
+#endif
+#ifdef HAS_WRITEV
+#include <sys/uio.h>
+#endif
 
 #include "t3widget/clipboard.h"
 #include "t3widget/double_string_adapter.h"
@@ -37,6 +50,151 @@
 
 namespace t3widget {
 
+#ifdef HAS_WRITEV
+/* Maximum number of iovecs passed to a single writev call. */
+#if defined(IOV_MAX) && IOV_MAX < 1024
+static const int write_batch_size = IOV_MAX;
+#else
+static const int write_batch_size = 1024;
+#endif
+
+/* Write all data described by iov, continuing after partial writes. The iovecs are modified to
+   keep track of the progress. Returns 0 on success or an errno value. */
+static int write_iovecs(int fd, struct iovec *iov, int count) {
+  while (count > 0) {
+    ssize_t result = writev(fd, iov, count);
+    if (result < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return errno;
+    } else if (result == 0) {
+      return EIO;
+    }
+    for (; count > 0 && static_cast<size_t>(result) >= iov->iov_len; ++iov, --count) {
+      result -= iov->iov_len;
+    }
+    if (count > 0) {
+      iov->iov_base = static_cast<char *>(iov->iov_base) + result;
+      iov->iov_len -= result;
+    }
+  }
+  return 0;
+}
+#endif
+
+static int write_lines(const line_tree_t &lines, int fd, line_ending_t line_ending) {
+  static const char crlf[] = "\r\n";
+  const string_view newline =
+      line_ending == line_ending_t::CRLF ? string_view(crlf, 2) : string_view(crlf + 1, 1);
+  const text_pos_t line_count = lines.size();
+
+#ifdef HAS_WRITEV
+  /* The iovecs refer directly to the data of the lines, interleaved with the line endings. */
+  struct iovec iov[write_batch_size];
+  int count = 0;
+  for (text_pos_t i = 0; i < line_count; ++i) {
+    if (count + 2 > write_batch_size) {
+      if (int error = write_iovecs(fd, iov, count)) {
+        return error;
+      }
+      count = 0;
+    }
+    string_view data = lines[i]->get_view();
+    if (!data.empty()) {
+      iov[count].iov_base = const_cast<char *>(data.data());
+      iov[count].iov_len = data.size();
+      ++count;
+    }
+    if (i + 1 < line_count) {
+      iov[count].iov_base = const_cast<char *>(newline.data());
+      iov[count].iov_len = newline.size();
+      ++count;
+    }
+  }
+  return write_iovecs(fd, iov, count);
+#else
+  /* Collect the lines in a limited size buffer, to reduce the number of write calls. */
+  const size_t buffer_size = 65536;
+  std::string buffer;
+  buffer.reserve(buffer_size);
+  for (text_pos_t i = 0; i < line_count; ++i) {
+    string_view data = lines[i]->get_view();
+    if (buffer.size() + data.size() + newline.size() > buffer_size) {
+      if (nosig_write(fd, buffer.data(), buffer.size()) < 0) {
+        return errno;
+      }
+      buffer.clear();
+    }
+    if (data.size() >= buffer_size) {
+      if (nosig_write(fd, data.data(), data.size()) < 0) {
+        return errno;
+      }
+    } else {
+      buffer.append(data.data(), data.size());
+    }
+    if (i + 1 < line_count) {
+      buffer.append(newline.data(), newline.size());
+    }
+  }
+  if (nosig_write(fd, buffer.data(), buffer.size()) < 0) {
+    return errno;
+  }
+  return 0;
+#endif
+}
+
+static int save_lines(const line_tree_t &lines, const std::string &name,
+                      line_ending_t line_ending) {
+  struct stat file_info;
+  std::string target = name;
+  bool exists = false;
+
+  /* Replace the file a symbolic link points to, rather than the link itself. */
+  std::unique_ptr<char, free_deleter> resolved(realpath(name.c_str(), nullptr));
+  if (resolved != nullptr) {
+    target = resolved.get();
+  }
+  if (stat(target.c_str(), &file_info) == 0) {
+    exists = true;
+  } else if (errno != ENOENT) {
+    return errno;
+  }
+
+  std::string temp_name;
+  int fd = -1;
+  for (int attempt = 0; fd < 0; ++attempt) {
+    temp_name = target + "." + std::to_string(getpid()) + "-" + std::to_string(attempt) + ".tmp";
+    if ((fd = open(temp_name.c_str(), O_WRONLY | O_CREAT | O_EXCL, 0666)) < 0 &&
+        (errno != EEXIST || attempt >= 100)) {
+      return errno;
+    }
+  }
+
+  int error = 0;
+  if (exists && fchmod(fd, file_info.st_mode & 07777) < 0) {
+    error = errno;
+  }
+  if (error == 0) {
+    error = write_lines(lines, fd, line_ending);
+  }
+  if (error == 0 && fsync(fd) < 0) {
+    error = errno;
+  }
+  if (close(fd) < 0 && error == 0) {
+    error = errno;
+  }
+  if (error == 0 && rename(temp_name.c_str(), target.c_str()) < 0) {
+    error = errno;
+  }
+  if (error != 0) {
+    unlink(temp_name.c_str());
+  }
+  return error;
+}
+
+//====================================== text_buffer_t =============================================
+
 text_buffer_t::text_buffer_t(text_line_factory_t *_line_factory)
     : impl(new implementation_t(_line_factory)) {}
 
@@ -44,7 +202,9 @@ text_buffer_t::~text_buffer_t() {}
 
 text_pos_t text_buffer_t::size() const { return impl->size(); }
 
-const text_line_t &text_buffer_t::get_line_data(text_pos_t idx) const { return *impl->lines[idx]; }
+const text_line_t &text_buffer_t::get_line_data(text_pos_t idx) const {
+  return *impl->lines.at(idx);
+}
 text_line_t *text_buffer_t::get_mutable_line_data(text_pos_t idx) { return impl->lines[idx].get(); }
 
 text_line_factory_t *text_buffer_t::get_line_factory() { return impl->line_factory; }
@@ -65,6 +225,16 @@ bool text_buffer_t::merge(bool backspace) { return impl->merge(backspace); }
 
 bool text_buffer_t::append_text(string_view text) { return impl->append_text(text); }
 
+int text_buffer_t::append_file(const std::string &name) { return impl->append_file(name); }
+
+int text_buffer_t::write_to_fd(int fd, line_ending_t line_ending) const {
+  return write_lines(impl->lines, fd, line_ending);
+}
+
+int text_buffer_t::save_file(const std::string &name, line_ending_t line_ending) const {
+  return save_lines(impl->lines, name, line_ending);
+}
+
 bool text_buffer_t::break_line(const std::string &indent) { return impl->break_line(indent); }
 
 text_pos_t text_buffer_t::calculate_screen_pos(int tabsize) const {
@@ -72,7 +242,7 @@ text_pos_t text_buffer_t::calculate_screen_pos(int tabsize) const {
 }
 
 text_pos_t text_buffer_t::calculate_screen_pos(const text_coordinate_t &where, int tabsize) const {
-  return impl->lines[where.line]->calculate_screen_width(0, where.pos, tabsize);
+  return impl->lines.at(where.line)->calculate_screen_width(0, where.pos, tabsize);
 }
 
 text_pos_t text_buffer_t::calculate_line_pos(text_pos_t line, text_pos_t pos, int tabsize) const {
@@ -82,11 +252,38 @@ text_pos_t text_buffer_t::calculate_line_pos(text_pos_t line, text_pos_t pos, in
 void text_buffer_t::paint_line(t3window::window_t *win, text_pos_t line,
                                const text_line_t::paint_info_t &info) {
   prepare_paint_line(line);
-  impl->lines[line]->paint_line(win, info);
+  impl->lines.at(line)->paint_line(win, info);
 }
 
 text_pos_t text_buffer_t::get_line_size(text_pos_t line) const { return impl->get_line_size(line); }
 
+text_pos_t text_buffer_t::get_byte_size() const { return impl->lines.total_bytes() - 1; }
+
+text_pos_t text_buffer_t::get_byte_offset(const text_coordinate_t &where) const {
+  return impl->lines.bytes_before(where.line) + where.pos;
+}
+
+text_coordinate_t text_buffer_t::get_coordinate_at_byte_offset(text_pos_t offset) const {
+  size_t line_offset = std::max<text_pos_t>(offset, 0);
+  text_pos_t line = impl->lines.find_byte_offset(&line_offset);
+  if (line >= size()) {
+    line = size() - 1;
+    return text_coordinate_t(line, get_line_size(line));
+  }
+
+  const text_line_t *line_data = impl->lines.at(line).get();
+  const string_view data = line_data->get_view();
+  text_pos_t pos = line_offset;
+  if (static_cast<size_t>(pos) >= data.size()) {
+    return text_coordinate_t(line, data.size());
+  }
+  /* Move to the start of the character containing the byte. */
+  while (pos > 0 && (data[pos] & 0xc0) == 0x80) {
+    --pos;
+  }
+  return text_coordinate_t(line, line_data->adjust_position(pos, 0));
+}
+
 void text_buffer_t::goto_next_word() { impl->goto_next_word(); }
 
 void text_buffer_t::goto_previous_word() { impl->goto_previous_word(); }
@@ -131,6 +328,27 @@ std::unique_ptr<std::string> text_buffer_t::convert_block(text_coordinate_t star
   return impl->convert_block(start, end);
 }
 
+std::vector<string_view> text_buffer_t::get_block_chunks(text_coordinate_t start,
+                                                         text_coordinate_t end) const {
+  return impl->get_block_chunks(start, end);
+}
+
+std::shared_ptr<const text_snapshot_t> text_buffer_t::create_snapshot() const {
+  /* Reading a line must not modify it once it is shared with the snapshot. Only the line being
+     edited can have a gap that reading the line moves (see changed()), so move it now. */
+  if (impl->editing_line >= 0 && impl->editing_line < size()) {
+    impl->lines.at(impl->editing_line)->get_view();
+  }
+  return std::shared_ptr<const text_snapshot_t>(
+      new text_snapshot_t(new text_snapshot_t::implementation_t(impl->mapped_files, impl->lines)));
+}
+
+uint64_t text_buffer_t::get_change_sequence() const { return impl->change_sequence; }
+
+uint64_t text_buffer_t::get_line_generation(text_pos_t line) const {
+  return impl->lines.at(line)->get_generation();
+}
+
 void text_buffer_t::set_undo_mark() { impl->set_undo_mark(); }
 
 /*FIXME: define return values for:
@@ -174,7 +392,9 @@ bool text_buffer_t::find_limited(finder_t *finder, text_coordinate_t start, text
 }
 
 void text_buffer_t::replace(const finder_t &finder, const find_result_t &result) {
-  std::string replacement_str = finder.get_replacement(impl->lines[result.start.line]->get_data());
+  std::string scratch;
+  std::string replacement_str =
+      finder.get_replacement(impl->get_match_data(result.start.line, &scratch));
   replace_block(result.start, result.end, replacement_str);
 }
 
@@ -216,6 +436,7 @@ void text_buffer_t::set_cursor(text_coordinate_t _cursor) { impl->cursor = _curs
 void text_buffer_t::set_cursor_pos(text_pos_t pos) { impl->cursor.pos = pos; }
 
 _T3_WIDGET_IMPL_SIGNAL(text_buffer_t, rewrap_required, rewrap_type_t, text_pos_t, text_pos_t)
+_T3_WIDGET_IMPL_SIGNAL(text_buffer_t, text_changed, const text_change_t &)
 
 //==================================== implementation_t ============================================
 
@@ -224,11 +445,58 @@ text_pos_t text_buffer_t::implementation_t::calculate_line_pos(text_pos_t line,
   return lines[line]->calculate_line_pos(0, std::numeric_limits<text_pos_t>::max(), pos, tabsize);
 }
 
+/* Returns the line at the cursor. When the cursor has moved to a different line, the previous
+   editing target is returned to its compact representation. */
+text_line_t *text_buffer_t::implementation_t::edit_target() {
+  if (editing_line != cursor.line) {
+    if (editing_line >= 0 && editing_line < size()) {
+      lines[editing_line]->minimize();
+    }
+    editing_line = cursor.line;
+  }
+  return lines[cursor.line].get();
+}
+
+/* Record a change to the text: update the change sequence, mark the first and last changed lines
+   with it and emit the text_changed signal. Lines inserted in between must already be marked.
+
+   Modified lines other than the editing line are returned to their compact representation, such
+   that block operations do not leave a buffer with room to grow on each line they touch. Only the
+   editing line can therefore have a gap in its buffer. editing_line is updated to keep referring to
+   the same line. */
+void text_buffer_t::implementation_t::changed(text_coordinate_t start, text_coordinate_t old_end,
+                                              text_coordinate_t new_end, text_pos_t deleted_bytes,
+                                              text_pos_t inserted_bytes) {
+  ++change_sequence;
+  lines[start.line]->set_generation(change_sequence);
+  lines[new_end.line]->set_generation(change_sequence);
+  if (start.line != editing_line || new_end.line != editing_line) {
+    if (editing_line > old_end.line) {
+      editing_line += new_end.line - old_end.line;
+    } else if (editing_line > start.line) {
+      editing_line = -1;
+    }
+    if (start.line != editing_line) {
+      lines[start.line]->minimize();
+    }
+    if (new_end.line != editing_line && new_end.line != start.line) {
+      lines[new_end.line]->minimize();
+    }
+  }
+  const text_change_t change = {change_sequence, start,         old_end,
+                                new_end,         deleted_bytes, inserted_bytes};
+  text_changed(change);
+}
+
 bool text_buffer_t::implementation_t::insert_char(key_t c) {
-  if (!lines[cursor.line]->insert_char(cursor.pos, c, get_undo(UNDO_ADD))) {
+  text_line_t *line = edit_target();
+  const text_pos_t old_size = line->size();
+  if (!line->insert_char(cursor.pos, c, get_undo(UNDO_ADD))) {
     return false;
   }
 
+  const text_pos_t inserted = line->size() - old_size;
+  changed(cursor, cursor, text_coordinate_t(cursor.line, cursor.pos + inserted), 0, inserted);
   rewrap_required(rewrap_type_t::REWRAP_LINE_LOCAL, cursor.line, cursor.pos);
 
   cursor.pos = lines[cursor.line]->adjust_position(cursor.pos, 1);
@@ -238,9 +506,18 @@ bool text_buffer_t::implementation_t::insert_char(key_t c) {
 }
 
 bool text_buffer_t::implementation_t::overwrite_char(key_t c) {
-  if (!lines[cursor.line]->overwrite_char(cursor.pos, c, get_undo(UNDO_OVERWRITE))) {
+  text_line_t *line = edit_target();
+  const text_coordinate_t start = cursor;
+  const text_pos_t old_size = line->size();
+  /* Zero-width characters are inserted rather than overwriting the character at the cursor. */
+  const text_pos_t deleted =
+      text_line_t::key_width(c) == 0 ? 0 : line->adjust_position(cursor.pos, 1) - cursor.pos;
+  if (!line->overwrite_char(cursor.pos, c, get_undo(UNDO_OVERWRITE))) {
     return false;
   }
+  const text_pos_t inserted = line->size() - old_size + deleted;
+  changed(start, text_coordinate_t(start.line, start.pos + deleted),
+          text_coordinate_t(start.line, start.pos + inserted), deleted, inserted);
   cursor.pos = lines[cursor.line]->adjust_position(cursor.pos, 0);
   rewrap_required(rewrap_type_t::REWRAP_LINE_LOCAL, cursor.line, cursor.pos);
 
@@ -251,9 +528,13 @@ bool text_buffer_t::implementation_t::overwrite_char(key_t c) {
 }
 
 bool text_buffer_t::implementation_t::delete_char() {
-  if (!lines[cursor.line]->delete_char(cursor.pos, get_undo(UNDO_DELETE))) {
+  text_line_t *line = edit_target();
+  const text_pos_t old_size = line->size();
+  if (!line->delete_char(cursor.pos, get_undo(UNDO_DELETE))) {
     return false;
   }
+  const text_pos_t deleted = old_size - line->size();
+  changed(cursor, text_coordinate_t(cursor.line, cursor.pos + deleted), cursor, deleted, 0);
   cursor.pos = lines[cursor.line]->adjust_position(cursor.pos, 0);
   rewrap_required(rewrap_type_t::REWRAP_LINE_LOCAL, cursor.line, cursor.pos);
   return true;
@@ -263,9 +544,14 @@ bool text_buffer_t::implementation_t::backspace_char() {
   text_pos_t newpos;
 
   newpos = lines[cursor.line]->adjust_position(cursor.pos, -1);
-  if (!lines[cursor.line]->backspace_char(cursor.pos, get_undo(UNDO_BACKSPACE))) {
+  text_line_t *line = edit_target();
+  const text_pos_t old_size = line->size();
+  if (!line->backspace_char(cursor.pos, get_undo(UNDO_BACKSPACE))) {
     return false;
   }
+  const text_pos_t deleted = old_size - line->size();
+  const text_coordinate_t start(cursor.line, cursor.pos - deleted);
+  changed(start, cursor, start, deleted, 0);
   cursor.pos = newpos;
   cursor.pos = lines[cursor.line]->adjust_position(cursor.pos, 0);
 
@@ -277,14 +563,18 @@ bool text_buffer_t::implementation_t::backspace_char() {
 
 bool text_buffer_t::implementation_t::backspace_word() {
   text_pos_t newpos;
-  text_line_t *line = lines[cursor.line].get();
+  text_line_t *line = edit_target();
   newpos = line->get_previous_word(cursor.pos);
   if (newpos < 0) {
     newpos = 0;
   }
+  const text_pos_t old_size = line->size();
   if (!line->backspace_word(cursor.pos, newpos, get_undo(UNDO_BACKSPACE))) {
     return false;
   }
+  const text_pos_t deleted = old_size - line->size();
+  const text_coordinate_t start(cursor.line, cursor.pos - deleted);
+  changed(start, cursor, start, deleted, 0);
   cursor.pos = newpos;
   cursor.pos = lines[cursor.line]->adjust_position(cursor.pos, 0);
 
@@ -298,9 +588,10 @@ bool text_buffer_t::implementation_t::merge_internal(text_pos_t line) {
   cursor.line = line;
   cursor.pos = lines[line]->size();
   lines[line]->merge(std::move(lines[line + 1]));
-  lines.erase(lines.begin() + line + 1);
+  lines.erase(line + 1, line + 2);
   rewrap_required(rewrap_type_t::DELETE_LINES, line + 1, line + 2);
   rewrap_required(rewrap_type_t::REWRAP_LINE, cursor.line, cursor.pos);
+  changed(cursor, text_coordinate_t(line + 1, 0), cursor, 1, 0);
   return true;
 }
 
@@ -308,26 +599,42 @@ bool text_buffer_t::implementation_t::insert_block_internal(text_coordinate_t in
                                                             std::unique_ptr<text_line_t> block) {
   std::unique_ptr<text_line_t> second_half, next_line;
   text_pos_t next_start = 0;
+  const text_pos_t inserted = block->size();
   // FIXME: check that everything succeeds and return false if it doesn't
-  if (insert_at.pos >= 0 && insert_at.pos < lines[insert_at.line]->size()) {
+  const text_pos_t line_size = lines[insert_at.line]->size();
+  if (insert_at.pos >= 0 && insert_at.pos < line_size) {
     second_half = lines[insert_at.line]->break_line(insert_at.pos);
   }
+  /* A block inserted at a position outside the line is appended to it, so that is where the
+     reported change starts. */
+  const text_coordinate_t start(insert_at.line, second_half != nullptr ? insert_at.pos : line_size);
 
   lines[insert_at.line]->merge(block->break_on_nl(&next_start));
   rewrap_required(rewrap_type_t::REWRAP_LINE, insert_at.line, insert_at.pos);
 
+  /* Split the remainder of the block into lines first, such that they can be spliced into the
+     list of lines in one go. */
+  std::vector<std::unique_ptr<text_line_t>> new_lines;
   while (next_start > 0) {
-    insert_at.line++;
-    lines.insert(lines.begin() + insert_at.line, block->break_on_nl(&next_start));
-    rewrap_required(rewrap_type_t::INSERT_LINES, insert_at.line, insert_at.line + 1);
+    new_lines.push_back(block->break_on_nl(&next_start));
+    new_lines.back()->set_generation(change_sequence + 1);
+  }
+
+  if (!new_lines.empty()) {
+    const text_pos_t first_new_line = insert_at.line + 1;
+    insert_at.line += new_lines.size();
+    lines.insert(first_new_line, std::move(new_lines));
+    rewrap_required(rewrap_type_t::INSERT_LINES, first_new_line, insert_at.line + 1);
   }
 
   cursor.pos = lines[insert_at.line]->size();
+  const text_coordinate_t end(insert_at.line, cursor.pos);
 
   if (second_half != nullptr) {
     lines[insert_at.line]->merge(std::move(second_half));
     rewrap_required(rewrap_type_t::REWRAP_LINE, insert_at.line, cursor.pos);
   }
+  changed(start, start, end, 0, inserted);
 
   cursor.line = insert_at.line;
   cursor.pos = lines[cursor.line]->adjust_position(cursor.pos, 0);
@@ -355,13 +662,18 @@ void text_buffer_t::implementation_t::delete_block_internal(text_coordinate_t st
   if (start.line == end.line) {
     std::unique_ptr<text_line_t> selected_text = lines[start.line]->cut_line(start.pos, end.pos);
     if (undo != nullptr) {
-      undo->get_text()->append(selected_text->get_data());
+      undo->get_text()->append(selected_text->get_view());
     }
     cursor.pos = lines[cursor.line]->adjust_position(cursor.pos, 0);
     rewrap_required(rewrap_type_t::REWRAP_LINE, start.line, start.pos);
+    changed(start, end, start, end.pos - start.pos, 0);
     return;
   }
 
+  const text_coordinate_t change_start = start, change_end = end;
+  const text_pos_t deleted =
+      lines.bytes_before(end.line) + end.pos - lines.bytes_before(start.line) - start.pos;
+
   /* Cases:
           - first line is completely removed
           - first/last line is broken halfway
@@ -387,7 +699,7 @@ void text_buffer_t::implementation_t::delete_block_internal(text_coordinate_t st
   } else if (start.pos != 0) {
     std::unique_ptr<text_line_t> retval = lines[start.line]->break_line(start.pos);
     if (undo != nullptr) {
-      undo->get_text()->append(retval->get_data());
+      undo->get_text()->append(retval->get_view());
     }
     start_part = lines[start.line].get();
   }
@@ -400,7 +712,7 @@ void text_buffer_t::implementation_t::delete_block_internal(text_coordinate_t st
 
   if (start_part == nullptr) {
     if (undo != nullptr) {
-      undo->get_text()->append(lines[start.line]->get_data());
+      undo->get_text()->append(lines[start.line]->get_view());
     }
     if (end_part != nullptr) {
       lines[start.line] = std::move(end_part);
@@ -419,16 +731,16 @@ void text_buffer_t::implementation_t::delete_block_internal(text_coordinate_t st
     undo->add_newline();
 
     for (text_pos_t i = start.line; i < end.line; i++) {
-      undo->get_text()->append(lines[i]->get_data());
+      undo->get_text()->append(lines[i]->get_view());
       undo->add_newline();
     }
 
     if (end.pos != 0) {
-      undo->get_text()->append(lines[end.line]->get_data());
+      undo->get_text()->append(lines[end.line]->get_view());
     }
   }
   end.line++;
-  lines.erase(lines.begin() + start.line, lines.begin() + end.line);
+  lines.erase(start.line, end.line);
   cursor.pos = lines[cursor.line]->adjust_position(cursor.pos, 0);
 
   rewrap_required(rewrap_type_t::DELETE_LINES, start.line, end.line);
@@ -436,11 +748,13 @@ void text_buffer_t::implementation_t::delete_block_internal(text_coordinate_t st
   if (static_cast<size_t>(start.line) < lines.size()) {
     rewrap_required(rewrap_type_t::REWRAP_LINE, start.line, 0);
   }
+  changed(change_start, change_end, change_start, deleted, 0);
 }
 
 bool text_buffer_t::implementation_t::break_line_internal(const std::string &indent) {
+  const text_coordinate_t start = cursor;
   std::unique_ptr<text_line_t> insert = lines[cursor.line]->break_line(cursor.pos);
-  lines.insert(lines.begin() + cursor.line + 1, std::move(insert));
+  lines.insert(cursor.line + 1, std::move(insert));
   rewrap_required(rewrap_type_t::REWRAP_LINE, cursor.line, cursor.pos);
   rewrap_required(rewrap_type_t::INSERT_LINES, cursor.line + 1, cursor.line + 2);
   cursor.line++;
@@ -452,6 +766,7 @@ bool text_buffer_t::implementation_t::break_line_internal(const std::string &ind
     lines[cursor.line] = std::move(new_line);
     cursor.pos = indent.size();
   }
+  changed(start, start, cursor, 0, indent.size() + 1);
   return true;
 }
 
@@ -474,6 +789,119 @@ bool text_buffer_t::implementation_t::append_text(string_view text) {
   return result;
 }
 
+mapped_file_t::~mapped_file_t() {
+#ifdef HAS_MMAP
+  munmap(const_cast<char *>(data), size);
+#endif
+}
+
+int text_buffer_t::implementation_t::append_file(const std::string &name) {
+  int fd;
+  struct stat file_info;
+
+  if ((fd = open(name.c_str(), O_RDONLY)) < 0) {
+    return errno;
+  }
+
+  if (fstat(fd, &file_info) < 0) {
+    int saved_errno = errno;
+    close(fd);
+    return saved_errno;
+  }
+
+#ifdef HAS_MMAP
+  if (S_ISREG(file_info.st_mode) && file_info.st_size > 0) {
+    const size_t file_size = file_info.st_size;
+    void *data = mmap(nullptr, file_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    int saved_errno = errno;
+    close(fd);
+    if (data == MAP_FAILED) {
+      return saved_errno;
+    }
+    mapped_files.push_back(
+        std::make_shared<mapped_file_t>(static_cast<const char *>(data), file_size));
+    append_mapped(string_view(static_cast<const char *>(data), file_size));
+    return 0;
+  }
+#endif
+
+  std::string contents;
+  char buffer[4096];
+  ssize_t bytes_read;
+  while ((bytes_read = nosig_read(fd, buffer, sizeof(buffer))) > 0) {
+    contents.append(buffer, bytes_read);
+  }
+  int saved_errno = errno;
+  close(fd);
+  if (bytes_read < 0) {
+    return saved_errno;
+  }
+  append_text(contents);
+  return 0;
+}
+
+/* Append the contents of a file mapping. All lines terminated by a newline refer to the mapping
+   if possible. The final (unterminated) line is always copied, such that no reads beyond the end
+   of the mapping can occur. */
+void text_buffer_t::implementation_t::append_mapped(string_view data) {
+  std::vector<std::unique_ptr<text_line_t>> new_lines;
+
+  const char *newline;
+  while ((newline = static_cast<const char *>(memchr(data.data(), '\n', data.size()))) !=
+         nullptr) {
+    string_view line_data = data.substr(0, newline - data.data());
+    data.remove_prefix(line_data.size() + 1);
+
+    std::unique_ptr<text_line_t> line;
+    if (is_round_trip_utf8(line_data)) {
+      line = line_factory->new_text_line_t(0);
+      line->set_external_data(line_data);
+    } else {
+      line = line_factory->new_text_line_t(line_data);
+    }
+    new_lines.push_back(std::move(line));
+  }
+  new_lines.push_back(line_factory->new_text_line_t(data));
+
+  append_lines(std::move(new_lines));
+  cursor.line = lines.size() - 1;
+  cursor.pos = lines[cursor.line]->size();
+}
+
+/* Append new_lines to the text, without moving the cursor or recording undo information. The first
+   line is merged into the last line of the text. Returns the index of the first changed line. */
+text_pos_t text_buffer_t::implementation_t::append_lines(
+    std::vector<std::unique_ptr<text_line_t>> new_lines) {
+  const text_pos_t last_line = lines.size() - 1;
+  const text_pos_t last_line_size = lines[last_line]->size();
+
+  text_pos_t inserted = new_lines.size() - 1;
+  for (const std::unique_ptr<text_line_t> &line : new_lines) {
+    inserted += line->size();
+    line->set_generation(change_sequence + 1);
+  }
+
+  /* If the last line is empty, it is simply replaced, such that the first new line need not be
+     copied. */
+  if (last_line_size == 0) {
+    lines[last_line] = std::move(new_lines.front());
+  } else {
+    lines[last_line]->merge(std::move(new_lines.front()));
+  }
+  rewrap_required(rewrap_type_t::REWRAP_LINE, last_line, last_line_size);
+
+  const text_coordinate_t start(last_line, last_line_size);
+  text_coordinate_t end(last_line, last_line_size + inserted);
+  if (new_lines.size() > 1) {
+    const text_pos_t new_size = lines.size() + new_lines.size() - 1;
+    lines.insert(last_line + 1, new_lines.begin() + 1, new_lines.end());
+    rewrap_required(rewrap_type_t::INSERT_LINES, last_line + 1, new_size);
+    end = text_coordinate_t(new_size - 1, lines[new_size - 1]->size());
+  }
+  changed(start, start, end, 0, inserted);
+  return last_line;
+}
+
 bool text_buffer_t::implementation_t::break_line(const std::string &indent) {
   start_undo_block();
   undo_t *undo = get_undo(UNDO_ADD);
@@ -523,8 +951,8 @@ bool text_buffer_t::implementation_t::replace_block(text_coordinate_t start, tex
   return true;
 }
 
-std::unique_ptr<std::string> text_buffer_t::implementation_t::convert_block(text_coordinate_t start,
-                                                                            text_coordinate_t end) {
+std::unique_ptr<std::string> text_buffer_t::implementation_t::convert_block(
+    text_coordinate_t start, text_coordinate_t end) const {
   text_coordinate_t current_start, current_end;
 
   current_start = start;
@@ -544,29 +972,60 @@ std::unique_ptr<std::string> text_buffer_t::implementation_t::convert_block(text
   }
 
   if (current_start.line == current_end.line) {
-    return t3widget::make_unique<std::string>(lines[current_start.line]->get_data(),
-                                              current_start.pos,
-                                              current_end.pos - current_start.pos);
+    const string_view data = lines[current_start.line]->get_view().substr(
+        current_start.pos, current_end.pos - current_start.pos);
+    return t3widget::make_unique<std::string>(data.data(), data.size());
   }
 
-  // FIXME: new and append may fail!
-  std::unique_ptr<std::string> retval(
-      new std::string(lines[current_start.line]->get_data(), current_start.pos));
+  /* The byte counts in the line tree give the size of the result, such that the string needs to
+     be allocated only once. */
+  std::unique_ptr<std::string> retval(new std::string);
+  retval->reserve(lines.bytes_before(current_end.line) + current_end.pos -
+                  lines.bytes_before(current_start.line) - current_start.pos);
+
+  const string_view first_data = lines[current_start.line]->get_view().substr(current_start.pos);
+  retval->append(first_data.data(), first_data.size());
   retval->append(1, '\n');
 
   for (text_pos_t i = current_start.line + 1; i < current_end.line; i++) {
-    // FIXME: append may fail!
-    retval->append(lines[i]->get_data());
+    const string_view data = lines[i]->get_view();
+    retval->append(data.data(), data.size());
     retval->append(1, '\n');
   }
 
-  // FIXME: append may fail!
-  retval->append(lines[current_end.line]->get_data(), 0, current_end.pos);
+  retval->append(lines[current_end.line]->get_view().data(), current_end.pos);
   return retval;
 }
 
+std::vector<string_view> text_buffer_t::implementation_t::get_block_chunks(
+    text_coordinate_t start, text_coordinate_t end) const {
+  static const char newline[] = "\n";
+  std::vector<string_view> chunks;
+
+  if (end < start) {
+    std::swap(start, end);
+  }
+
+  if (start.line == end.line) {
+    if (start.pos != end.pos) {
+      chunks.push_back(lines[start.line]->get_view().substr(start.pos, end.pos - start.pos));
+    }
+    return chunks;
+  }
+
+  chunks.reserve(2 * (end.line - start.line) + 1);
+  chunks.push_back(lines[start.line]->get_view().substr(start.pos));
+  chunks.push_back(string_view(newline, 1));
+  for (text_pos_t i = start.line + 1; i < end.line; i++) {
+    chunks.push_back(lines[i]->get_view());
+    chunks.push_back(string_view(newline, 1));
+  }
+  chunks.push_back(lines[end.line]->get_view().substr(0, end.pos));
+  return chunks;
+}
+
 void text_buffer_t::implementation_t::goto_next_word() {
-  text_line_t *line = lines[cursor.line].get();
+  const text_line_t *line = lines.at(cursor.line).get();
 
   /* Use -1 as an indicator for end of line */
   if (cursor.pos >= line->size()) {
@@ -576,7 +1035,7 @@ void text_buffer_t::implementation_t::goto_next_word() {
       if (static_cast<size_t>(cursor.line) + 1 >= lines.size()) {
         break;
       }
-      line = lines[++cursor.line].get();
+      line = lines.at(++cursor.line).get();
       cursor.pos = line->get_next_word(-1);
     }
   } else if (cursor.pos >= 0) {
@@ -590,13 +1049,13 @@ void text_buffer_t::implementation_t::goto_next_word() {
 }
 
 void text_buffer_t::implementation_t::goto_previous_word() {
-  text_line_t *line = lines[cursor.line].get();
+  const text_line_t *line = lines.at(cursor.line).get();
 
   cursor.pos = line->get_previous_word(cursor.pos);
 
   /* Keep skipping to next line if no word can be found */
   while (cursor.pos < 0 && cursor.line > 0) {
-    line = lines[--cursor.line].get();
+    line = lines.at(--cursor.line).get();
     cursor.pos = line->get_previous_word(-1);
   }
 
@@ -607,15 +1066,15 @@ void text_buffer_t::implementation_t::goto_previous_word() {
 }
 
 void text_buffer_t::implementation_t::goto_next_word_boundary() {
-  cursor.pos = lines[cursor.line]->get_next_word_boundary(cursor.pos);
+  cursor.pos = lines.at(cursor.line)->get_next_word_boundary(cursor.pos);
 }
 
 void text_buffer_t::implementation_t::goto_previous_word_boundary() {
-  cursor.pos = lines[cursor.line]->get_previous_word_boundary(cursor.pos);
+  cursor.pos = lines.at(cursor.line)->get_previous_word_boundary(cursor.pos);
 }
 
 void text_buffer_t::implementation_t::adjust_position(int adjust) {
-  cursor.pos = lines[cursor.line]->adjust_position(cursor.pos, adjust);
+  cursor.pos = lines.at(cursor.line)->adjust_position(cursor.pos, adjust);
 }
 
 int text_buffer_t::implementation_t::width_at_cursor() const {
@@ -784,9 +1243,25 @@ void text_buffer_t::implementation_t::set_selection_from_find(const find_result_
   set_primary(convert_block(selection_start, selection_end));
 }
 
+/* Get the contents of a line for matching. Lines not stored in a std::string, such as compact lines
+   or lines referring to a file mapping, are copied into scratch, rather than making them keep a
+   copy of their contents. */
+const std::string &text_buffer_t::implementation_t::get_match_data(text_pos_t line,
+                                                                   std::string *scratch) const {
+  const text_line_t *text_line = lines[line].get();
+  const std::string *string_data = text_line->get_string_data();
+  if (string_data != nullptr) {
+    return *string_data;
+  }
+  const string_view data = text_line->get_view();
+  scratch->assign(data.data(), data.size());
+  return *scratch;
+}
+
 bool text_buffer_t::implementation_t::find(finder_t *finder, find_result_t *result,
                                            bool reverse) const {
   text_pos_t start, idx;
+  std::string scratch;
 
   /* Note: the value of result->start.line and result->end.line are ignored after the
      search has started. The finder->match function does not take those values into
@@ -797,7 +1272,7 @@ bool text_buffer_t::implementation_t::find(finder_t *finder, find_result_t *resu
     start = idx = result->start.line;
     result->end = result->start;
     result->start.pos = -1;
-    if (finder->match(lines[idx]->get_data(), result, true)) {
+    if (finder->match(get_match_data(idx, &scratch), result, true)) {
       result->start.line = result->end.line = idx;
       return true;
     }
@@ -805,7 +1280,7 @@ bool text_buffer_t::implementation_t::find(finder_t *finder, find_result_t *resu
     result->end.pos = -1;
     for (; idx > 0;) {
       idx--;
-      if (finder->match(lines[idx]->get_data(), result, true)) {
+      if (finder->match(get_match_data(idx, &scratch), result, true)) {
         result->start.line = result->end.line = idx;
         return true;
       }
@@ -817,7 +1292,7 @@ bool text_buffer_t::implementation_t::find(finder_t *finder, find_result_t *resu
 
     for (idx = lines.size(); idx > start;) {
       idx--;
-      if (finder->match(lines[idx]->get_data(), result, true)) {
+      if (finder->match(get_match_data(idx, &scratch), result, true)) {
         result->start.line = result->end.line = idx;
         return true;
       }
@@ -826,7 +1301,7 @@ bool text_buffer_t::implementation_t::find(finder_t *finder, find_result_t *resu
     start = idx = cursor.line;
     result->start = cursor;
     result->end.pos = -1;
-    if (finder->match(lines[idx]->get_data(), result, false)) {
+    if (finder->match(get_match_data(idx, &scratch), result, false)) {
       result->start.line = result->end.line = idx;
       return true;
     }
@@ -834,7 +1309,7 @@ bool text_buffer_t::implementation_t::find(finder_t *finder, find_result_t *resu
     result->start.pos = -1;
     const size_t lines_size = lines.size();
     for (idx++; idx < static_cast<text_pos_t>(lines_size); idx++) {
-      if (finder->match(lines[idx]->get_data(), result, false)) {
+      if (finder->match(get_match_data(idx, &scratch), result, false)) {
         result->start.line = result->end.line = idx;
         return true;
       }
@@ -845,7 +1320,7 @@ bool text_buffer_t::implementation_t::find(finder_t *finder, find_result_t *resu
     }
 
     for (idx = 0; idx <= start; idx++) {
-      if (finder->match(lines[idx]->get_data(), result, false)) {
+      if (finder->match(get_match_data(idx, &scratch), result, false)) {
         result->start.line = result->end.line = idx;
         return true;
       }
@@ -859,6 +1334,7 @@ bool text_buffer_t::implementation_t::find_limited(finder_t *finder, text_coordi
                                                    text_coordinate_t end,
                                                    find_result_t *result) const {
   text_pos_t idx;
+  std::string scratch;
 
   /* Note: the finder->match function does not take value of result->start.line
      and result->end.line into account. */
@@ -866,7 +1342,7 @@ bool text_buffer_t::implementation_t::find_limited(finder_t *finder, text_coordi
   result->end.pos = -1;
 
   for (idx = start.line; static_cast<size_t>(idx) < lines.size() && idx < end.line; idx++) {
-    if (finder->match(lines[idx]->get_data(), result, false)) {
+    if (finder->match(get_match_data(idx, &scratch), result, false)) {
       result->start.line = result->end.line = idx;
       return true;
     }
@@ -875,7 +1351,7 @@ bool text_buffer_t::implementation_t::find_limited(finder_t *finder, text_coordi
 
   result->end = end;
   if (static_cast<size_t>(idx) < lines.size() &&
-      finder->match(lines[idx]->get_data(), result, false)) {
+      finder->match(get_match_data(idx, &scratch), result, false)) {
     result->start.line = result->end.line = idx;
     return true;
   }
@@ -1007,8 +1483,9 @@ bool text_buffer_t::implementation_t::unindent_block(text_coordinate_t &start,
 
   delete_start.pos = 0;
   for (; delete_start.line <= end_line; delete_start.line++) {
-    const std::string &data = lines[delete_start.line]->get_data();
-    for (delete_end.pos = 0; delete_end.pos < tabsize; delete_end.pos++) {
+    const string_view data = lines.at(delete_start.line)->get_view();
+    const text_pos_t limit = std::min<text_pos_t>(tabsize, data.size());
+    for (delete_end.pos = 0; delete_end.pos < limit; delete_end.pos++) {
       if (data[delete_end.pos] == '\t') {
         delete_end.pos++;
         break;
@@ -1017,7 +1494,7 @@ bool text_buffer_t::implementation_t::unindent_block(text_coordinate_t &start,
       }
     }
 
-    undo_text.append(data, 0, delete_end.pos);
+    undo_text.append(data.data(), delete_end.pos);
     undo_text.append(1, 'X');  // Simply add a non-space/tab as marker
     if (delete_end.pos == 0) {
       continue;
@@ -1064,8 +1541,9 @@ bool text_buffer_t::implementation_t::unindent_line(int tabsize) {
     set_selection_mode(selection_mode_t::NONE);
   }
 
-  const std::string &data = lines[delete_start.line]->get_data();
-  for (; delete_end.pos < tabsize; delete_end.pos++) {
+  const string_view data = lines.at(delete_start.line)->get_view();
+  const text_pos_t limit = std::min<text_pos_t>(tabsize, data.size());
+  for (; delete_end.pos < limit; delete_end.pos++) {
     if (data[delete_end.pos] == '\t') {
       delete_end.pos++;
       break;
@@ -1079,7 +1557,7 @@ bool text_buffer_t::implementation_t::unindent_line(int tabsize) {
   }
 
   undo = get_undo(UNDO_UNINDENT, std::min(delete_start, cursor));
-  undo->get_text()->append(string_view(data).substr(0, delete_end.pos));
+  undo->get_text()->append(data.substr(0, delete_end.pos));
   undo->get_text()->append("X");
 
   /* delete_block_interal sets the cursor position to the position where the
@@ -1110,4 +1588,24 @@ void text_buffer_t::implementation_t::goto_pos(text_pos_t line, text_pos_t pos)
   }
 }
 
+//==================================== text_snapshot_t =============================================
+
+text_snapshot_t::text_snapshot_t(implementation_t *_impl) : impl(_impl) {}
+
+text_snapshot_t::~text_snapshot_t() {}
+
+text_pos_t text_snapshot_t::size() const { return impl->lines.size(); }
+
+string_view text_snapshot_t::get_line(text_pos_t idx) const {
+  return impl->lines[idx]->get_view();
+}
+
+int text_snapshot_t::write_to_fd(int fd, line_ending_t line_ending) const {
+  return write_lines(impl->lines, fd, line_ending);
+}
+
+int text_snapshot_t::save_file(const std::string &name, line_ending_t line_ending) const {
+  return save_lines(impl->lines, name, line_ending);
+}
+
 }  // namespace t3widget
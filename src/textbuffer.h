@@ -14,6 +14,7 @@
 #ifndef T3_WIDGET_TEXTBUFFER_H
 #define T3_WIDGET_TEXTBUFFER_H
 
+#include <cstdint>
 #include <cstdio>
 #include <memory>
 #include <string>
@@ -26,10 +27,32 @@ namespace t3widget {
 
 struct find_result_t;
 class finder_t;
+class text_snapshot_t;
 class wrap_info_t;
 
+/** Description of a single change to the text of a text_buffer_t.
+
+    Each change replaces the range [@c start, @c old_end) of the text before the change, by the
+    range [@c start, @c new_end) of the text after the change. Either range may be empty.
+*/
+struct T3_WIDGET_API text_change_t {
+  /** Sequence number of the change. The first change to a text_buffer_t has sequence number 1. */
+  uint64_t sequence;
+  /** Start of the changed range. */
+  text_coordinate_t start;
+  /** End of the deleted range, in coordinates before the change. */
+  text_coordinate_t old_end;
+  /** End of the inserted range, in coordinates after the change. */
+  text_coordinate_t new_end;
+  /** Number of bytes deleted, counting one byte per line separator. */
+  text_pos_t deleted_bytes;
+  /** Number of bytes inserted, counting one byte per line separator. */
+  text_pos_t inserted_bytes;
+};
+
 class T3_WIDGET_API text_buffer_t {
   friend class wrap_info_t;
+  friend class text_loader_t;
 
  private:
   struct T3_WIDGET_LOCAL implementation_t;
@@ -63,8 +86,41 @@ class T3_WIDGET_API text_buffer_t {
   bool insert_block(const std::string &block);
 
   bool append_text(string_view text);
+  /** Append the contents of the file @p name to the text, like append_text.
+      @return 0 on success, or an @c errno value describing the error.
+
+      Where supported, the file is mapped into memory, and lines are not copied until they are
+      modified. The file should therefore not be modified in place while the text refers to it.
+  */
+  int append_file(const std::string &name);
+  /** Write the text to the file descriptor @p fd, using @p line_ending to end the lines.
+      @return 0 on success, or an @c errno value describing the error.
+
+      The lines are written directly from the text, such that no copy of the whole text is made.
+  */
+  int write_to_fd(int fd, line_ending_t line_ending = line_ending_t::LF) const;
+  /** Save the text to the file @p name, using @p line_ending to end the lines.
+      @return 0 on success, or an @c errno value describing the error.
+
+      The text is first written to a temporary file in the same directory, which is then renamed
+      to @p name. If an error occurs, the existing file is therefore left unchanged. The existing
+      permissions of the file are preserved. Lines referring to a file mapped by append_file remain
+      valid, even when that file is replaced.
+  */
+  int save_file(const std::string &name, line_ending_t line_ending = line_ending_t::LF) const;
 
   text_pos_t get_line_size(text_pos_t line) const;
+  /** Returns the size of the text in bytes, counting one byte for each line separator. */
+  text_pos_t get_byte_size() const;
+  /** Returns the byte offset of @p where in the text, counting one byte for each line separator.
+
+      This is an O(log n) operation. */
+  text_pos_t get_byte_offset(const text_coordinate_t &where) const;
+  /** Returns the coordinate of the character containing the byte at @p offset.
+
+      Offsets of line separators map to the end of the preceding line. Offsets beyond the end of
+      the text map to the end of the last line. This is an O(log n) operation. */
+  text_coordinate_t get_coordinate_at_byte_offset(text_pos_t offset) const;
   void adjust_position(int adjust);
   int width_at_cursor() const;
 
@@ -108,6 +164,13 @@ class T3_WIDGET_API text_buffer_t {
 
   bool is_modified() const;
   std::unique_ptr<std::string> convert_block(text_coordinate_t start, text_coordinate_t end);
+  /** Returns the text between @p start and @p end as a list of chunks, without copying it.
+
+      The chunks refer to the data of the lines, and line separators are returned as separate
+      chunks. The chunks are only valid until the text is modified. The order of @p start and
+      @p end is not important.
+  */
+  std::vector<string_view> get_block_chunks(text_coordinate_t start, text_coordinate_t end) const;
   int apply_undo();
   int apply_redo();
   void start_undo_block();
@@ -130,7 +193,61 @@ class T3_WIDGET_API text_buffer_t {
   void set_cursor(text_coordinate_t _cursor);
   void set_cursor_pos(text_pos_t pos);
 
+  /** Create a read-only snapshot of the current contents of the text.
+
+      Creating a snapshot is an O(1) operation, as the snapshot shares its lines with the text.
+      Parts of the text that are modified while a snapshot exists are copied first.
+  */
+  std::shared_ptr<const text_snapshot_t> create_snapshot() const;
+
+  /** Returns the sequence number of the last change to the text, or 0 if it was never changed. */
+  uint64_t get_change_sequence() const;
+  /** Returns the sequence number of the last change that modified line @p line.
+
+      Lines that were not modified since they were inserted return the sequence number of the
+      change that inserted them. Moving a line by inserting or deleting lines before it does not
+      change its generation. */
+  uint64_t get_line_generation(text_pos_t line) const;
+
   T3_WIDGET_DECLARE_SIGNAL(rewrap_required, rewrap_type_t, text_pos_t, text_pos_t);
+  /** @fn connection_t connect_text_changed(std::function<void(const text_change_t &)> func)
+      Connect a callback to the #text_changed signal.
+  */
+  /** Signal emitted after each change to the text, with a description of the change. */
+  T3_WIDGET_DECLARE_SIGNAL(text_changed, const text_change_t &);
+};
+
+/** Read-only view of the contents of a text_buffer_t at the time the snapshot was created.
+
+    Unlike the text_buffer_t itself, a snapshot may be used from any thread, for example to search
+    or save the text, while the text_buffer_t is modified on the main thread. The snapshot must be
+    destroyed before the text_line_factory_t of the text_buffer_t is destroyed, but it may outlive
+    the text_buffer_t.
+
+    Lines of the text that are modified while a snapshot exists are first copied using
+    text_line_t::clone. Data stored by classes derived from text_line_t is therefore not
+    preserved in that case.
+*/
+class T3_WIDGET_API text_snapshot_t {
+  friend class text_buffer_t;
+
+ private:
+  struct T3_WIDGET_LOCAL implementation_t;
+  pimpl_t<implementation_t> impl;
+
+  text_snapshot_t(implementation_t *_impl);
+
+ public:
+  ~text_snapshot_t();
+
+  /** Returns the number of lines in the snapshot. */
+  text_pos_t size() const;
+  /** Returns the contents of line @p idx. */
+  string_view get_line(text_pos_t idx) const;
+  /** Write the snapshot to the file descriptor @p fd, like text_buffer_t::write_to_fd. */
+  int write_to_fd(int fd, line_ending_t line_ending = line_ending_t::LF) const;
+  /** Save the snapshot to the file @p name, like text_buffer_t::save_file. */
+  int save_file(const std::string &name, line_ending_t line_ending = line_ending_t::LF) const;
 };
 
 }  // namespace t3widget
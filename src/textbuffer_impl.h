@@ -18,13 +18,38 @@
 #error This header file is for internal use _only_!!
 #endif
 
+#include <cstddef>
+#include <memory>
+#include <t3widget/linetree.h>
 #include <t3widget/textbuffer.h>
 #include <t3widget/undo.h>
+#include <vector>
 
 namespace t3widget {
 
+/* Read-only mapping of a file, which the lines appended by append_file refer to. */
+struct mapped_file_t {
+  const char *data;
+  size_t size;
+
+  mapped_file_t(const char *_data, size_t _size) : data(_data), size(_size) {}
+  ~mapped_file_t();
+};
+
+struct text_snapshot_t::implementation_t {
+  /* Must be declared before lines, such that the mappings outlive the lines referring to them. */
+  const std::vector<std::shared_ptr<mapped_file_t>> mapped_files;
+  const line_tree_t lines;
+
+  implementation_t(const std::vector<std::shared_ptr<mapped_file_t>> &_mapped_files,
+                   const line_tree_t &_lines)
+      : mapped_files(_mapped_files), lines(_lines) {}
+};
+
 struct text_buffer_t::implementation_t {
-  std::vector<std::unique_ptr<text_line_t>> lines;
+  /* Must be declared before lines, such that the mappings outlive the lines referring to them. */
+  std::vector<std::shared_ptr<mapped_file_t>> mapped_files;
+  line_tree_t lines;
   text_coordinate_t selection_start;
   text_coordinate_t selection_end;
   selection_mode_t selection_mode;
@@ -36,7 +61,13 @@ struct text_buffer_t::implementation_t {
 
   text_line_factory_t *line_factory;
   signal_t<rewrap_type_t, text_pos_t, text_pos_t> rewrap_required;
+  signal_t<const text_change_t &> text_changed;
+  /* Sequence number of the last change to the text. */
+  uint64_t change_sequence = 0;
   text_coordinate_t cursor;
+  /* Index of the line last modified by a character operation, which keeps its growable buffer
+     until another line becomes the editing target. */
+  text_pos_t editing_line = -1;
 
   implementation_t(text_line_factory_t *_line_factory)
       : selection_start(-1, 0),
@@ -53,6 +84,9 @@ struct text_buffer_t::implementation_t {
   text_pos_t size() const { return lines.size(); }
   text_pos_t get_line_size(text_pos_t line) const { return lines[line]->size(); }
   text_pos_t calculate_line_pos(text_pos_t line, text_pos_t pos, int tabsize) const;
+  text_line_t *edit_target();
+  void changed(text_coordinate_t start, text_coordinate_t old_end, text_coordinate_t new_end,
+               text_pos_t deleted_bytes, text_pos_t inserted_bytes);
   bool insert_char(key_t c);
   bool overwrite_char(key_t c);
   bool delete_char();
@@ -63,11 +97,15 @@ struct text_buffer_t::implementation_t {
   void delete_block_internal(text_coordinate_t start, text_coordinate_t end, undo_t *undo);
   bool break_line_internal(const std::string &indent = nullptr);
   bool append_text(string_view text);
+  int append_file(const std::string &name);
+  void append_mapped(string_view data);
+  text_pos_t append_lines(std::vector<std::unique_ptr<text_line_t>> new_lines);
   bool break_line(const std::string &indent);
   bool merge(bool backspace);
   bool insert_block(const std::string &block);
   bool replace_block(text_coordinate_t start, text_coordinate_t end, const std::string &block);
-  std::unique_ptr<std::string> convert_block(text_coordinate_t start, text_coordinate_t end);
+  std::unique_ptr<std::string> convert_block(text_coordinate_t start, text_coordinate_t end) const;
+  std::vector<string_view> get_block_chunks(text_coordinate_t start, text_coordinate_t end) const;
   void goto_next_word();
   void goto_previous_word();
   void goto_next_word_boundary();
@@ -84,6 +122,7 @@ struct text_buffer_t::implementation_t {
   void set_undo_mark();
   void apply_undo_redo(undo_type_t type, undo_t *current);
   void set_selection_from_find(const find_result_t &result);
+  const std::string &get_match_data(text_pos_t line, std::string *scratch) const;
   bool find(finder_t *finder, find_result_t *result, bool reverse) const;
   bool find_limited(finder_t *finder, text_coordinate_t start, text_coordinate_t end,
                     find_result_t *result) const;
@@ -16,12 +16,21 @@
 
 #include <algorithm>
 #include <cstdint>
+#include <cstddef>
 #include <cstring>
+#include <limits>
 #include <memory>
+#include <mutex>
 #include <string>
 #include <t3window/utf8.h>
 #include <type_traits>
-#include <unictype.h>
+#include <vector>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
 
 #include "t3widget/colorscheme.h"
 #include "t3widget/double_string_adapter.h"
@@ -62,19 +71,560 @@ static bool is_conjoining_jamo_lv(uint32_t c) {
   return false;
 }
 
+/* Returns the number of bytes at the start of data[0, size) that are printable ASCII characters.
+   Each of these takes up exactly one screen column. The vector versions check 32 or 16 bytes at a
+   time, using signed comparisons such that bytes >= 0x80 are also rejected. */
+static size_t printable_ascii_run(const char *data, size_t size) {
+  size_t i = 0;
+#ifdef __AVX2__
+  const __m256i low_avx = _mm256_set1_epi8(0x1f);
+  const __m256i high_avx = _mm256_set1_epi8(0x7f);
+  for (; i + 32 <= size; i += 32) {
+    __m256i bytes = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(data + i));
+    __m256i printable = _mm256_and_si256(_mm256_cmpgt_epi8(bytes, low_avx),
+                                         _mm256_cmpgt_epi8(high_avx, bytes));
+    uint32_t mask = static_cast<uint32_t>(_mm256_movemask_epi8(printable));
+    if (mask != 0xffffffffu) {
+      return i + __builtin_ctz(~mask);
+    }
+  }
+#endif
+#ifdef __SSE2__
+  const __m128i low = _mm_set1_epi8(0x1f);
+  const __m128i high = _mm_set1_epi8(0x7f);
+  for (; i + 16 <= size; i += 16) {
+    __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + i));
+    __m128i printable = _mm_and_si128(_mm_cmpgt_epi8(bytes, low), _mm_cmplt_epi8(bytes, high));
+    uint32_t mask = static_cast<uint32_t>(_mm_movemask_epi8(printable));
+    if (mask != 0xffff) {
+      return i + __builtin_ctz(~mask);
+    }
+  }
+#endif
+  for (; i < size; ++i) {
+    unsigned char c = static_cast<unsigned char>(data[i]);
+    if (c < 0x20 || c >= 0x7f) {
+      break;
+    }
+  }
+  return i;
+}
+
+/* Set by text_line_t::init if the terminal can draw all printable ASCII characters. */
+static bool can_draw_ascii;
+
+/* Distance in bytes between column checkpoints in long lines. */
+static const text_pos_t column_checkpoint_interval = 4096;
+
+/* Minimum size in bytes of lines stored in shared storage. */
+static const text_pos_t shared_storage_threshold = 65536;
+
+static bool is_printable_ascii(char c) {
+  return static_cast<unsigned char>(c) >= 0x20 && static_cast<unsigned char>(c) < 0x7f;
+}
+
+/* Memory arena from which a text_line_factory_t allocates its lines. Memory is taken from large
+   blocks, which are only released when the arena is destroyed. Objects that are freed are kept on
+   a free list per size for reuse. The text of lines is allocated from the same blocks, but is not
+   reused. */
+class text_line_arena_t {
+ public:
+  void *allocate(size_t size);
+  void deallocate(void *ptr, size_t size);
+  char *allocate_text(size_t size);
+
+ private:
+  static const size_t block_size = 256 * 1024;
+  static const size_t granularity = alignof(std::max_align_t);
+  /* Largest size for which freed objects are kept for reuse. */
+  static const size_t max_reuse_size = 256;
+
+  struct free_item_t {
+    free_item_t *next;
+  };
+
+  std::mutex lock;
+  std::vector<std::unique_ptr<char[]>> blocks;
+  char *next_free = nullptr;
+  size_t remaining = 0;
+  free_item_t *free_lists[max_reuse_size / granularity] = {};
+
+  char *allocate_bytes(size_t size, size_t align);
+};
+
+char *text_line_arena_t::allocate_bytes(size_t size, size_t align) {
+  size_t padding = (align - reinterpret_cast<uintptr_t>(next_free) % align) % align;
+  if (padding + size > remaining) {
+    /* Large allocations get a block of their own, such that the remainder of the current block is
+       not wasted. */
+    if (size > block_size / 4) {
+      blocks.emplace_back(new char[size]);
+      return blocks.back().get();
+    }
+    blocks.emplace_back(new char[block_size]);
+    next_free = blocks.back().get();
+    remaining = block_size;
+    padding = 0;
+  }
+  char *result = next_free + padding;
+  next_free += padding + size;
+  remaining -= padding + size;
+  return result;
+}
+
+void *text_line_arena_t::allocate(size_t size) {
+  size = (size + granularity - 1) / granularity * granularity;
+  std::lock_guard<std::mutex> guard(lock);
+  if (size <= max_reuse_size) {
+    free_item_t **free_list = &free_lists[size / granularity - 1];
+    if (*free_list != nullptr) {
+      free_item_t *result = *free_list;
+      *free_list = result->next;
+      return result;
+    }
+  }
+  return allocate_bytes(size, granularity);
+}
+
+void text_line_arena_t::deallocate(void *ptr, size_t size) {
+  size = (size + granularity - 1) / granularity * granularity;
+  if (size > max_reuse_size) {
+    return;
+  }
+  std::lock_guard<std::mutex> guard(lock);
+  free_item_t **free_list = &free_lists[size / granularity - 1];
+  free_item_t *item = static_cast<free_item_t *>(ptr);
+  item->next = *free_list;
+  *free_list = item;
+}
+
+char *text_line_arena_t::allocate_text(size_t size) {
+  std::lock_guard<std::mutex> guard(lock);
+  return allocate_bytes(size, 1);
+}
+
+/* Objects allocated by allocate_tagged store the arena they were allocated from (or nullptr)
+   directly after the object, such that deallocate_tagged can return the memory to the right
+   place. */
+static size_t tag_offset(size_t size) {
+  return (size + alignof(text_line_arena_t *) - 1) / alignof(text_line_arena_t *) *
+         alignof(text_line_arena_t *);
+}
+
+static void *allocate_tagged(size_t size, text_line_arena_t *arena) {
+  const size_t offset = tag_offset(size);
+  const size_t total_size = offset + sizeof(text_line_arena_t *);
+  void *result = arena == nullptr ? ::operator new(total_size) : arena->allocate(total_size);
+  memcpy(static_cast<char *>(result) + offset, &arena, sizeof(text_line_arena_t *));
+  return result;
+}
+
+static void deallocate_tagged(void *ptr, size_t size) {
+  if (ptr == nullptr) {
+    return;
+  }
+  const size_t offset = tag_offset(size);
+  text_line_arena_t *arena;
+  memcpy(&arena, static_cast<char *>(ptr) + offset, sizeof(text_line_arena_t *));
+  if (arena == nullptr) {
+    ::operator delete(ptr);
+  } else {
+    arena->deallocate(ptr, offset + sizeof(text_line_arena_t *));
+  }
+}
+
 struct text_line_t::implementation_t {
-  std::string buffer;
+  /* The contents of lines that are not being edited. Short lines are stored inline, longer lines in
+     an exactly sized allocation. */
+  tiny_string_t compact;
+  /* Growable buffer for the contents of the line. This is only allocated once the line is
+     modified, and released again by text_line_t::minimize. When present, it holds the contents of
+     the line and compact and external are empty. Use data() to read the contents of the line and
+     replace() to modify them.
+
+     The buffer is a gap buffer: the gap_size bytes starting at gap_start are not part of the
+     line. Modifications move the gap to the modified position, such that a sequence of edits at
+     the same position only moves the bytes in between. Reading the whole line through data()
+     moves the gap to the end of the buffer. The functions used while editing, such as painting,
+     wrapping and width calculations, read the line through view_at instead, which does not move
+     the gap. */
+  std::unique_ptr<std::string> buffer;
+  mutable text_pos_t gap_start;
+  mutable text_pos_t gap_size;
+  /* For lines with external data, the bytes of the line. These are stored either in a file
+     mapping (see text_buffer_t::append_file), in the arena of the text_line_factory_t or in
+     shared. For all other lines external.data() is nullptr. */
+  string_view external;
+  /* Reference counted storage for long lines, which external refers to. Lines created by clone or
+     break_line from a line with shared storage refer to the same storage, such that long lines
+     can be split and copied without copying their contents. The storage is not modified until
+     only a single line refers to it. */
+  std::shared_ptr<std::string> shared;
   text_line_factory_t *factory;
   bool starts_with_combining;
+  /* Lazily computed properties of the contents of the line, which allow common cases to skip
+     decoding the UTF-8 data. Reset by invalidate_metadata whenever the contents change. */
+  mutable uint8_t metadata;
+  /* Screen width of the whole line, if the WIDTH_VALID bit is set in metadata. Only used for
+     lines without tabs, as otherwise the width depends on the tab size. */
+  mutable text_pos_t display_width;
+  /* See text_line_t::set_generation. */
+  uint64_t generation;
+
+  struct column_checkpoint_t {
+    text_pos_t pos;
+    text_pos_t column;
+  };
+  /* Screen columns at regular intervals in long lines, computed from the start of the line using
+     tabsize. Each checkpoint is at the start of a character that is not zero-width. Checkpoints
+     after the start of a modification are removed by invalidate_metadata. */
+  struct column_checkpoints_t {
+    int tabsize;
+    std::vector<column_checkpoint_t> points;
+  };
+  mutable std::unique_ptr<column_checkpoints_t> checkpoints;
+
+  /* Runs of cursor positions (position 0 and the starts of characters that are not zero-width)
+     with the same character class, used by the word motion functions. Consecutive runs have
+     different classes. The runs are computed lazily from the start of the line, and only describe
+     the positions before end: the last run may extend beyond end. Runs starting after the start of
+     a modification are removed by invalidate_metadata. */
+  struct class_run_t {
+    text_pos_t start;
+    int cclass;
+  };
+  struct class_runs_t {
+    text_pos_t end = 0;
+    std::vector<class_run_t> runs;
+  };
+  mutable std::unique_ptr<class_runs_t> class_runs;
+
+  enum {
+    METADATA_VALID = (1 << 0),
+    ASCII_ONLY = (1 << 1),
+    HAS_TAB = (1 << 2),
+    HAS_CONTROL = (1 << 3),
+    WIDTH_VALID = (1 << 4),
+  };
 
   implementation_t(text_line_factory_t *_factory)
-      : factory(_factory == nullptr ? &default_text_line_factory : _factory),
-        starts_with_combining(false) {}
+      : gap_start(0),
+        gap_size(0),
+        factory(_factory == nullptr ? &default_text_line_factory : _factory),
+        starts_with_combining(false),
+        metadata(0),
+        display_width(0),
+        generation(0) {}
+
+  static void *operator new(size_t size, text_line_arena_t *arena) {
+    return allocate_tagged(size, arena);
+  }
+  static void operator delete(void *ptr, size_t size) { deallocate_tagged(ptr, size); }
+  static void operator delete(void *ptr, text_line_arena_t *arena) {
+    if (arena == nullptr) {
+      ::operator delete(ptr);
+    }
+  }
+
+  string_view data() const {
+    if (buffer != nullptr) {
+      move_gap(buffer->size() - gap_size);
+      return string_view(buffer->data(), gap_start);
+    }
+    return external.data() == nullptr ? string_view(compact) : external;
+  }
+  text_pos_t size() const {
+    if (buffer != nullptr) {
+      return buffer->size() - gap_size;
+    }
+    return external.data() == nullptr ? compact.size() : external.size();
+  }
+  /* Returns a view of the start of the line, which includes at least the first end bytes (or the
+     whole line if it is shorter). Unlike data(), this only moves the gap if it is before end. */
+  string_view prefix(text_pos_t end) const {
+    if (buffer == nullptr || gap_size == 0) {
+      return data();
+    }
+    if (gap_start < end) {
+      move_gap(std::min(end, size()));
+    }
+    return string_view(buffer->data(), gap_start);
+  }
+  /* Returns a view of the line that is indexed by position in the line, for reading the bytes
+     from pos up to the gap (if pos is before the gap) or up to the end of the line. Before pos
+     only the lookback bytes preceding it can be read, as well as all bytes if pos is before the
+     gap. Unlike data(), this does not move the gap, unless it is less than lookback bytes before
+     pos. Readers that scan the line fetch a new view when they reach the end of the view, i.e.
+     the size of the view is not the size of the line. */
+  string_view view_at(text_pos_t pos, text_pos_t lookback = 0) const {
+    if (buffer == nullptr || gap_size == 0) {
+      return data();
+    }
+    if (pos >= gap_start && pos - lookback < gap_start) {
+      move_gap(std::max<text_pos_t>(pos - lookback, 0));
+    }
+    if (pos < gap_start) {
+      return string_view(buffer->data(), gap_start);
+    }
+    /* The view starts gap_size bytes into the buffer, such that the bytes after the gap are at
+       their position in the line. The bytes before the gap are not part of the view's valid
+       range, but the view does not extend beyond the buffer. */
+    return string_view(buffer->data() + gap_size, size());
+  }
+  /* Move the gap of the buffer, such that it starts at pos. This does not change the contents of
+     the line, and is a no-op if the gap is already at pos. The latter allows data() to be called
+     from multiple threads, once the gap has been moved to the end. */
+  void move_gap(text_pos_t pos) const {
+    if (pos == gap_start) {
+      return;
+    }
+    if (gap_size != 0) {
+      char *bytes = &(*buffer)[0];
+      if (pos < gap_start) {
+        memmove(bytes + pos + gap_size, bytes + pos, gap_start - pos);
+      } else {
+        memmove(bytes + gap_start, bytes + gap_start + gap_size, pos - gap_start);
+      }
+    }
+    gap_start = pos;
+  }
+  /* Remove the gap from the buffer, such that the buffer holds exactly the contents of the line.
+     The memory of the gap remains allocated as the capacity of the buffer. */
+  void close_gap() const {
+    if (gap_size != 0) {
+      move_gap(buffer->size() - gap_size);
+      buffer->resize(gap_start);
+      gap_size = 0;
+    }
+  }
+  /* Replace the length bytes at pos by text. */
+  void replace(text_pos_t pos, text_pos_t length, string_view text) {
+    materialize();
+    invalidate_metadata(pos);
+    move_gap(pos);
+    /* The replaced bytes simply become part of the gap. */
+    gap_size += length;
+    const text_pos_t text_size = text.size();
+    if (gap_size < text_size) {
+      /* Grow the gap in proportion to the size of the line, such that the cost of moving the bytes
+         after the gap is amortized over many insertions. */
+      const text_pos_t grow = text_size - gap_size + (buffer->size() - gap_size) / 8 + 64;
+      buffer->insert(gap_start + gap_size, grow, '\0');
+      gap_size += grow;
+    }
+    std::copy(text.begin(), text.end(), buffer->begin() + gap_start);
+    gap_start += text_size;
+    gap_size -= text_size;
+  }
+  /* Copy the external or compact data of a line into buffer. */
+  void materialize() {
+    if (buffer == nullptr) {
+      if (shared != nullptr && is_only_reference(shared)) {
+        /* This is the only line referring to the storage, so the storage can become the buffer. */
+        const text_pos_t offset = external.data() - shared->data();
+        buffer.reset(new std::string(std::move(*shared)));
+        buffer->resize(offset + external.size());
+        buffer->erase(0, offset);
+      } else {
+        const string_view contents = data();
+        buffer.reset(new std::string(contents.data(), contents.size()));
+      }
+      external = string_view();
+      shared.reset();
+      compact = tiny_string_t();
+      gap_size = 0;
+    }
+  }
+  /* Make the line refer to slice of storage. */
+  void set_shared(std::shared_ptr<std::string> storage, string_view slice) {
+    release_buffer();
+    compact = tiny_string_t();
+    shared = std::move(storage);
+    external = slice;
+  }
+  /* Move the contents of the line into shared storage, if they are not there already. */
+  void share_contents() {
+    if (shared != nullptr) {
+      return;
+    }
+    std::shared_ptr<std::string> storage;
+    if (buffer != nullptr) {
+      close_gap();
+      storage.reset(buffer.release());
+    } else {
+      const string_view contents = data();
+      storage = std::make_shared<std::string>(contents.data(), contents.size());
+    }
+    set_shared(storage, *storage);
+  }
+  /* Discard the buffer, if any. */
+  void release_buffer() {
+    buffer.reset();
+    gap_size = 0;
+  }
+  /* Store the contents of the line in compact (or in shared storage for long lines), releasing
+     the buffer. */
+  void compact_buffer() {
+    if (buffer != nullptr) {
+      if (size() >= shared_storage_threshold) {
+        share_contents();
+      } else {
+        compact = tiny_string_t(data());
+        release_buffer();
+      }
+    }
+  }
+  void truncate(text_pos_t pos) {
+    invalidate_metadata(pos);
+    if (buffer != nullptr) {
+      /* Keep the gap, which is at the end of the buffer after truncating. */
+      move_gap(pos);
+      buffer->resize(pos + gap_size);
+    } else if (external.data() != nullptr) {
+      external = external.substr(0, pos);
+    } else {
+      compact = tiny_string_t(string_view(compact).substr(0, pos));
+    }
+  }
+
+  void invalidate_metadata(text_pos_t from = 0) {
+    metadata = 0;
+    if (checkpoints != nullptr) {
+      std::vector<column_checkpoint_t> &points = checkpoints->points;
+      points.erase(std::upper_bound(points.begin(), points.end(), from,
+                                    [](text_pos_t pos, const column_checkpoint_t &checkpoint) {
+                                      return pos < checkpoint.pos;
+                                    }),
+                   points.end());
+    }
+    if (class_runs != nullptr) {
+      std::vector<class_run_t> &runs = class_runs->runs;
+      runs.erase(std::lower_bound(runs.begin(), runs.end(), from,
+                                  [](const class_run_t &run, text_pos_t pos) {
+                                    return run.start < pos;
+                                  }),
+                 runs.end());
+      class_runs->end = std::min(class_runs->end, from);
+    }
+  }
+  int get_metadata() const {
+    if (!(metadata & METADATA_VALID)) {
+      compute_metadata();
+    }
+    return metadata;
+  }
+  /* Returns true if the line consists only of printable ASCII characters and tabs. For such lines
+     every byte is a character of width 1 (tabs excepted, where their width is relevant). */
+  bool is_simple_ascii() const {
+    return (get_metadata() & (ASCII_ONLY | HAS_CONTROL)) == ASCII_ONLY;
+  }
+  void compute_metadata() const;
+
+  /* Returns the index of the class run containing cursor position pos. */
+  size_t class_run_at(text_pos_t pos) const {
+    if (class_runs == nullptr || class_runs->end <= pos) {
+      scan_class_runs(pos + 1);
+    }
+    const std::vector<class_run_t> &runs = class_runs->runs;
+    return std::upper_bound(runs.begin(), runs.end(), pos,
+                            [](text_pos_t pos, const class_run_t &run) {
+                              return pos < run.start;
+                            }) -
+           runs.begin() - 1;
+  }
+  /* Returns the position following class run idx, i.e. the start of the next run or the end of the
+     line. */
+  text_pos_t class_run_end(size_t idx) const {
+    const std::vector<class_run_t> &runs = class_runs->runs;
+    while (runs.size() <= idx + 1 && class_runs->end < size()) {
+      scan_class_runs(class_runs->end + 4096);
+    }
+    return runs.size() > idx + 1 ? runs[idx + 1].start : size();
+  }
+  int class_run_class(size_t idx) const { return class_runs->runs[idx].cclass; }
+  text_pos_t class_run_start(size_t idx) const { return class_runs->runs[idx].start; }
+  void scan_class_runs(text_pos_t min_end) const;
 };
 
+/* Extend the class runs to describe at least the positions before min_end. */
+void text_line_t::implementation_t::scan_class_runs(text_pos_t min_end) const {
+  if (class_runs == nullptr) {
+    class_runs.reset(new class_runs_t);
+  }
+  const text_pos_t contents_size = size();
+  const bool simple = is_simple_ascii();
+  std::vector<class_run_t> &runs = class_runs->runs;
+  text_pos_t pos = class_runs->end;
+  string_view contents = view_at(pos);
+  while (pos < min_end && pos < contents_size) {
+    if (static_cast<size_t>(pos) >= contents.size()) {
+      contents = view_at(pos);
+    }
+    if (pos == 0 || simple || width_at(contents, pos) != 0) {
+      const int cclass = get_class(contents, pos);
+      if (runs.empty() || runs.back().cclass != cclass) {
+        runs.push_back(class_run_t{pos, cclass});
+      }
+    }
+    pos += simple ? 1 : byte_width_from_first(contents, pos);
+  }
+  class_runs->end = std::min(pos, contents_size);
+}
+
+void text_line_t::implementation_t::compute_metadata() const {
+  bool ascii_only = true, has_tab = false, has_control = false;
+  /* The parts of the line before and after the gap are scanned separately. */
+  const size_t contents_size = size();
+  size_t i = 0;
+  while (i < contents_size) {
+    const string_view contents = view_at(i);
+    i += printable_ascii_run(contents.data() + i, contents.size() - i);
+    if (i == contents.size()) {
+      continue;
+    }
+    unsigned char uc = static_cast<unsigned char>(contents[i]);
+    if (uc >= 0x80) {
+      ascii_only = false;
+    } else if (uc == '\t') {
+      has_tab = true;
+    } else if (uc < 32 || uc == 0x7f) {
+      has_control = true;
+    }
+    ++i;
+  }
+  metadata = METADATA_VALID | (ascii_only ? ASCII_ONLY : 0) | (has_tab ? HAS_TAB : 0) |
+             (has_control ? HAS_CONTROL : 0);
+}
+
+/* Check whether the conversion done by fill_line would leave the bytes in line unchanged. */
+bool is_round_trip_utf8(string_view line) {
+  char byte_buffer[5];
+
+  while (!line.empty()) {
+    if (static_cast<unsigned char>(line[0]) < 0x80) {
+      line.remove_prefix(1);
+      continue;
+    }
+    size_t char_bytes = line.size();
+    key_t c = t3_utf8_get(line.data(), &char_bytes);
+    size_t round_trip_bytes = t3_utf8_put(c, byte_buffer);
+    if (round_trip_bytes != char_bytes || memcmp(byte_buffer, line.data(), char_bytes) != 0) {
+      return false;
+    }
+    line.remove_prefix(char_bytes);
+  }
+  return true;
+}
+
+static text_line_arena_t *get_factory_arena(text_line_factory_t *factory) {
+  return (factory == nullptr ? &default_text_line_factory : factory)->get_arena();
+}
+
 text_line_t::text_line_t(int buffersize, text_line_factory_t *factory)
-    : impl(new implementation_t(factory)) {
-  reserve(buffersize);
+    : impl(new (get_factory_arena(factory)) implementation_t(factory)) {
+  /* Space is no longer reserved up front: a line only gets a growable buffer once it is modified.
+     The buffersize parameter is kept for compatibility. */
+  (void)buffersize;
 }
 
 text_line_t::~text_line_t() {}
@@ -83,41 +633,84 @@ void text_line_t::fill_line(string_view _buffer) {
   size_t char_bytes, round_trip_bytes;
   key_t next;
   char byte_buffer[5];
+  std::string converted;
+
+  /* Most text does not change by the conversion, in which case it can be stored directly. */
+  if (!is_round_trip_utf8(_buffer)) {
+    converted.reserve(_buffer.size());
+    while (!_buffer.empty()) {
+      char_bytes = _buffer.size();
+      next = t3_utf8_get(_buffer.data(), &char_bytes);
+      round_trip_bytes = t3_utf8_put(next, byte_buffer);
+      converted.append(byte_buffer, round_trip_bytes);
+      _buffer.remove_prefix(char_bytes);
+    }
+    _buffer = converted;
+  }
 
-  /* If _buffer is valid UTF-8, we will end up with a buffer of size length.
-     So just tell the buffer that, such that it can allocate an appropriately
-     sized buffer. */
-  reserve(_buffer.size());
-
-  while (!_buffer.empty()) {
-    char_bytes = _buffer.size();
-    next = t3_utf8_get(_buffer.data(), &char_bytes);
-    round_trip_bytes = t3_utf8_put(next, byte_buffer);
-    impl->buffer.append(byte_buffer, round_trip_bytes);
-    _buffer.remove_prefix(char_bytes);
+  /* fill_line is only called on empty lines. */
+  impl->invalidate_metadata();
+  if (_buffer.size() >= static_cast<size_t>(shared_storage_threshold)) {
+    std::shared_ptr<std::string> storage =
+        std::make_shared<std::string>(_buffer.data(), _buffer.size());
+    impl->set_shared(storage, *storage);
+  } else if (impl->buffer != nullptr) {
+    impl->buffer->assign(_buffer.data(), _buffer.size());
+    impl->gap_size = 0;
+  } else {
+    impl->compact = tiny_string_t(_buffer);
   }
-  impl->starts_with_combining = impl->buffer.size() > 0 && width_at(0) == 0;
+  impl->starts_with_combining = size() > 0 && width_at(0) == 0;
 }
 
 text_line_t::text_line_t(string_view buffer, text_line_factory_t *factory)
-    : impl(new implementation_t(factory)) {
+    : impl(new (get_factory_arena(factory)) implementation_t(factory)) {
+  /* If the text does not need conversion, lines from a factory using an arena store it in the
+     arena until the line is modified. */
+  text_line_arena_t *arena = impl->factory->get_arena();
+  if (arena != nullptr && !buffer.empty() &&
+      buffer.size() < static_cast<size_t>(shared_storage_threshold) && is_round_trip_utf8(buffer)) {
+    char *data = arena->allocate_text(buffer.size());
+    memcpy(data, buffer.data(), buffer.size());
+    set_external_data(string_view(data, buffer.size()));
+    return;
+  }
   fill_line(buffer);
 }
 
+void *text_line_t::operator new(size_t size) { return allocate_tagged(size, nullptr); }
+
+void *text_line_t::operator new(size_t size, text_line_arena_t *arena) {
+  return allocate_tagged(size, arena);
+}
+
+void text_line_t::operator delete(void *ptr, size_t size) { deallocate_tagged(ptr, size); }
+
+void text_line_t::operator delete(void *ptr, text_line_arena_t *arena) {
+  /* Only called when a constructor throws. Memory from an arena is simply left in the arena. */
+  if (arena == nullptr) {
+    ::operator delete(ptr);
+  }
+}
+
 void text_line_t::set_text(string_view buffer) {
-  impl->buffer.clear();
+  impl->external = string_view();
+  impl->shared.reset();
+  impl->compact = tiny_string_t();
+  if (impl->buffer != nullptr) {
+    impl->buffer->clear();
+    impl->gap_size = 0;
+  }
   fill_line(buffer);
 }
 
 /* Merge line2 into line1, freeing line2 */
 void text_line_t::merge(std::unique_ptr<text_line_t> other) {
-  if (impl->buffer.empty() && other->impl->starts_with_combining) {
+  if (size() == 0 && other->impl->starts_with_combining) {
     impl->starts_with_combining = true;
   }
 
-  reserve(impl->buffer.size() + other->impl->buffer.size());
-
-  impl->buffer += other->impl->buffer;
+  impl->replace(size(), 0, other->impl->data());
 }
 
 /* Break up 'line' at position 'pos'. This means that the character at 'pos'
@@ -127,90 +720,111 @@ std::unique_ptr<text_line_t> text_line_t::break_line(t3widget::text_pos_t pos) {
   std::unique_ptr<text_line_t> newline;
 
   // FIXME: cut_line and break_line are very similar. Maybe we should combine them!
-  if (static_cast<size_t>(pos) == impl->buffer.size()) {
+  const string_view data = impl->data();
+  if (static_cast<size_t>(pos) == data.size()) {
     return impl->factory->new_text_line_t();
   }
 
   /* Only allow line breaks at non-combining marks. This doesn't use width_at, because
      conjoining Jamo will make it return 0, but we need to allow them to be split. */
-  ASSERT(t3_utf8_wcwidth(t3_utf8_get(impl->buffer.data() + pos, nullptr)));
+  ASSERT(t3_utf8_wcwidth(t3_utf8_get(data.data() + pos, nullptr)));
 
-  /* copy the right part of the string into the new buffer */
-  newline = impl->factory->new_text_line_t(impl->buffer.size() - pos);
-  newline->impl->buffer.assign(impl->buffer.data() + pos, impl->buffer.size() - pos);
+  newline = impl->factory->new_text_line_t(data.size() - pos);
+  if (static_cast<text_pos_t>(data.size()) - pos >= shared_storage_threshold) {
+    /* Let the new line refer to the right part of the shared contents of this line. */
+    impl->share_contents();
+    newline->impl->set_shared(impl->shared, impl->external.substr(pos));
+  } else {
+    /* copy the right part of the string into the new buffer */
+    newline->impl->compact = tiny_string_t(data.substr(pos));
+  }
 
-  impl->buffer.resize(pos);
+  impl->truncate(pos);
   return newline;
 }
 
 std::unique_ptr<text_line_t> text_line_t::cut_line(text_pos_t start, text_pos_t end) {
   std::unique_ptr<text_line_t> retval;
 
-  ASSERT(static_cast<size_t>(end) == impl->buffer.size() ||
-         t3_utf8_wcwidth(t3_utf8_get(impl->buffer.data() + end, nullptr)) != 0);
+  ASSERT(end == size() || t3_utf8_wcwidth(t3_utf8_get(impl->data().data() + end, nullptr)) != 0);
   // FIXME: special case: if the selection cover a whole text_line_t (note: not wrapped) we
   // shouldn't copy
 
   retval = clone(start, end);
 
-  impl->buffer.erase(start, (end - start));
-  impl->starts_with_combining = !impl->buffer.empty() && width_at(0) == 0;
+  if (end == size()) {
+    impl->truncate(start);
+  } else {
+    impl->replace(start, end - start, string_view());
+  }
+  impl->starts_with_combining = size() > 0 && width_at(0) == 0;
 
   return retval;
 }
 
 std::unique_ptr<text_line_t> text_line_t::clone(text_pos_t start, text_pos_t end) {
   if (end == -1) {
-    end = impl->buffer.size();
+    end = size();
   }
 
-  ASSERT(static_cast<size_t>(end) <= impl->buffer.size());
+  ASSERT(end <= size());
   ASSERT(start >= 0);
   ASSERT(start <= end);
 
+  std::unique_ptr<text_line_t> retval = impl->factory->new_text_line_t(end - start);
+  /* Copies of a whole line, such as those made when a line shared with a snapshot is modified,
+     should keep their generation. */
+  retval->impl->generation = impl->generation;
   if (start == end) {
-    return impl->factory->new_text_line_t(0);
+    return retval;
   }
 
-  std::unique_ptr<text_line_t> retval = impl->factory->new_text_line_t((end - start));
-
-  retval->impl->buffer.assign(impl->buffer.data() + start, (end - start));
+  const string_view contents = impl->data().substr(start, end - start);
+  if (end - start >= shared_storage_threshold) {
+    /* The contents of this line are not moved to shared storage here, because clone is also used
+       to copy lines that are shared with a snapshot, which may be read from another thread. */
+    if (impl->shared != nullptr) {
+      retval->impl->set_shared(impl->shared, contents);
+    } else {
+      std::shared_ptr<std::string> storage =
+          std::make_shared<std::string>(contents.data(), contents.size());
+      retval->impl->set_shared(storage, *storage);
+    }
+  } else {
+    retval->impl->compact = tiny_string_t(contents);
+  }
   retval->impl->starts_with_combining = width_at(start) == 0;
 
   return retval;
 }
 
 std::unique_ptr<text_line_t> text_line_t::break_on_nl(text_pos_t *startFrom) {
+  const string_view data = impl->data();
   text_pos_t i;
 
-  for (i = *startFrom; static_cast<size_t>(i) < impl->buffer.size(); i++) {
-    if (impl->buffer[i] == '\n') {
+  for (i = *startFrom; static_cast<size_t>(i) < data.size(); i++) {
+    if (data[i] == '\n') {
       break;
     }
   }
 
   std::unique_ptr<text_line_t> retval = clone(*startFrom, i);
 
-  *startFrom = static_cast<size_t>(i) == impl->buffer.size() ? -1 : i + 1;
+  *startFrom = static_cast<size_t>(i) == data.size() ? -1 : i + 1;
   return retval;
 }
 
 void text_line_t::insert(std::unique_ptr<text_line_t> other, t3widget::text_pos_t pos) {
-  ASSERT(pos >= 0 && static_cast<size_t>(pos) <= impl->buffer.size());
+  ASSERT(pos >= 0 && pos <= size());
 
-  reserve(impl->buffer.size() + other->impl->buffer.size());
-  impl->buffer.insert(pos, other->impl->buffer);
+  impl->replace(pos, 0, other->impl->data());
   if (pos == 0) {
     impl->starts_with_combining = other->impl->starts_with_combining;
   }
 }
 
 void text_line_t::minimize() {
-#ifdef HAS_STRING_SHRINK_TO_FIT
-  impl->buffer.shrink_to_fit();
-#else
-  reserve(0);
-#endif
+  impl->compact_buffer();
 }
 
 /* Calculate the screen width of the characters from 'start' to 'pos' with tabsize 'tabsize' */
@@ -219,20 +833,111 @@ text_pos_t text_line_t::calculate_screen_width(text_pos_t start, text_pos_t pos,
                                                int tabsize) const {
   text_pos_t i, total = 0;
 
+  const text_pos_t line_size = size();
+  const int metadata = impl->get_metadata();
+  const bool simple = impl->is_simple_ascii();
+  if (simple && !(metadata & implementation_t::HAS_TAB)) {
+    return std::max<text_pos_t>(0, std::min<text_pos_t>(pos, line_size) - start);
+  }
+
+  /* The width of a line without tabs does not depend on the tab size, so it can be cached. */
+  const bool whole_line =
+      start == 0 && pos >= line_size && !(metadata & implementation_t::HAS_TAB);
+  if (whole_line && (metadata & implementation_t::WIDTH_VALID)) {
+    return impl->display_width;
+  }
+
   if (impl->starts_with_combining && start == 0 && pos > 0) {
     total++;
   }
 
-  for (i = start; static_cast<size_t>(i) < impl->buffer.size() && i < pos;
-       i += byte_width_from_first(i)) {
-    if (impl->buffer[i] == '\t') {
-      total += tabsize > 0 ? tabsize - (total % tabsize) : 2;
+  i = start;
+  if (start == 0) {
+    find_column_checkpoint(pos, std::numeric_limits<text_pos_t>::max(), tabsize, &i, &total);
+  }
+  add_screen_width(&i, std::min<text_pos_t>(pos, line_size), &total, tabsize);
+
+  if (whole_line) {
+    impl->display_width = total;
+    impl->metadata |= implementation_t::WIDTH_VALID;
+  }
+  return total;
+}
+
+/* Add the screen width of the characters from *pos up to end to *total, where *total is the
+   screen column at *pos relative to the start of the tab stops. On return *pos is end, or the
+   start of the first character after it if end is not at a character boundary. A tab size of 0
+   displays tabs as control characters. */
+void text_line_t::add_screen_width(text_pos_t *pos, text_pos_t end, text_pos_t *total,
+                                   int tabsize) const {
+  const bool simple = impl->is_simple_ascii();
+  text_pos_t i = *pos;
+  string_view data = impl->view_at(i);
+  while (i < end) {
+    if (static_cast<size_t>(i) >= data.size()) {
+      data = impl->view_at(i);
+    }
+    if (is_printable_ascii(data[i])) {
+      /* Runs of printable ASCII characters are counted in one go. */
+      text_pos_t run =
+          printable_ascii_run(data.data() + i, std::min<text_pos_t>(end, data.size()) - i);
+      *total += run;
+      i += run;
+      continue;
+    }
+    if (data[i] == '\t') {
+      *total += tabsize > 0 ? tabsize - (*total % tabsize) : 2;
     } else {
-      total += width_at(i);
+      *total += simple ? 1 : width_at(i);
     }
+    i += simple ? 1 : byte_width_from_first(data, i);
   }
+  *pos = i;
+}
 
-  return total;
+/* Find the last column checkpoint before byte max_pos and screen column max_column, for
+   calculations starting at the start of the line. The checkpoints are extended as far as
+   necessary. If there is no suitable checkpoint, *pos and *column are left unchanged. */
+void text_line_t::find_column_checkpoint(text_pos_t max_pos, text_pos_t max_column, int tabsize,
+                                         text_pos_t *pos, text_pos_t *column) const {
+  const text_pos_t line_size = size();
+  if (max_pos < column_checkpoint_interval || line_size < 2 * column_checkpoint_interval ||
+      impl->starts_with_combining) {
+    return;
+  }
+
+  std::unique_ptr<implementation_t::column_checkpoints_t> &checkpoints = impl->checkpoints;
+  if (checkpoints == nullptr || checkpoints->tabsize != tabsize) {
+    checkpoints.reset(new implementation_t::column_checkpoints_t{tabsize, {}});
+  }
+  std::vector<implementation_t::column_checkpoint_t> &points = checkpoints->points;
+
+  text_pos_t scan_pos = 0, scan_column = 0;
+  if (!points.empty()) {
+    scan_pos = points.back().pos;
+    scan_column = points.back().column;
+  }
+  while (scan_column < max_column && scan_pos + column_checkpoint_interval <= max_pos) {
+    add_screen_width(&scan_pos, std::min(scan_pos + column_checkpoint_interval, line_size),
+                     &scan_column, tabsize);
+    while (scan_pos < line_size && width_at(scan_pos) == 0) {
+      scan_pos += byte_width_from_first(scan_pos);
+    }
+    if (scan_pos >= line_size) {
+      break;
+    }
+    points.push_back({scan_pos, scan_column});
+  }
+
+  auto checkpoint = std::partition_point(
+      points.begin(), points.end(), [=](const implementation_t::column_checkpoint_t &point) {
+        return point.pos <= max_pos && point.column < max_column;
+      });
+  if (checkpoint != points.begin()) {
+    --checkpoint;
+    *pos = checkpoint->pos;
+    *column = checkpoint->column;
+  }
 }
 
 /* Return the line position in text_line_t associated with screen position 'pos' or
@@ -245,21 +950,46 @@ text_pos_t text_line_t::calculate_line_pos(text_pos_t start, text_pos_t max, tex
     return start;
   }
 
+  const bool simple = impl->is_simple_ascii();
+  if (simple && !(impl->get_metadata() & implementation_t::HAS_TAB)) {
+    return std::min(start + pos, std::min<text_pos_t>(max, size()));
+  }
+
   if (start == 0 && impl->starts_with_combining) {
     pos--;
   }
 
-  for (i = start; static_cast<size_t>(i) < impl->buffer.size() && i < max;
-       i += byte_width_from_first(i)) {
-    if (impl->buffer[i] == '\t') {
+  const text_pos_t end = std::min<text_pos_t>(max, size());
+  i = start;
+  if (start == 0 && tabsize > 0) {
+    find_column_checkpoint(end, pos + 1, tabsize, &i, &total);
+  }
+  string_view data = impl->view_at(i);
+  while (i < end) {
+    if (static_cast<size_t>(i) >= data.size()) {
+      data = impl->view_at(i);
+    }
+    if (is_printable_ascii(data[i])) {
+      /* Runs of printable ASCII characters are skipped in one go, as each takes up one column. */
+      text_pos_t run =
+          printable_ascii_run(data.data() + i, std::min<text_pos_t>(end, data.size()) - i);
+      if (total + run > pos) {
+        return i + (pos - total);
+      }
+      total += run;
+      i += run;
+      continue;
+    }
+    if (data[i] == '\t') {
       total += tabsize - (total % tabsize);
     } else {
-      total += width_at(i);
+      total += simple ? 1 : width_at(i);
     }
 
     if (total > pos) {
       return i;
     }
+    i += simple ? 1 : byte_width_from_first(data, i);
   }
 
   return std::min(max, size());
@@ -330,14 +1060,68 @@ void text_line_t::paint_line(t3window::window_t *win, const text_line_t::paint_i
     total++;
   }
 
-  const size_t buffer_size = impl->buffer.size();
-  const char *buffer_data = impl->buffer.data();
-
-  text_pos_t i;
-  for (i = info.start; static_cast<size_t>(i) < buffer_size && i < info.max && total < info.leftcol;
-       i += byte_width_from_first(i)) {
-    if (width_at(i) != 0) {
-      selection_attr = get_draw_attrs(i, info);
+  /* The line is read through views that do not move the gap of a line being edited (see
+     implementation_t::view_at). The view is advanced when the position reaches its end. */
+  const size_t buffer_size = impl->size();
+  string_view data = impl->view_at(info.start);
+  const char *buffer_data = data.data();
+  auto advance_view = [&](text_pos_t pos) {
+    if (static_cast<size_t>(pos) >= data.size() && static_cast<size_t>(pos) < buffer_size) {
+      data = impl->view_at(pos);
+      buffer_data = data.data();
+    }
+  };
+  /* Lines with only printable ASCII characters (and tabs) don't need to be decoded. */
+  const bool simple = impl->is_simple_ascii();
+  auto char_width = [&](text_pos_t pos) { return simple ? 1 : width_at(pos); };
+  auto char_bytes = [&](text_pos_t pos) { return simple ? 1 : byte_width_from_first(pos); };
+  auto char_is_print = [&](text_pos_t pos) {
+    return simple ? static_cast<size_t>(pos) < buffer_size : is_print(pos);
+  };
+  /* Returns true if the character at pos is printable ASCII which is not followed by a zero-width
+     character, such that it is known to be drawable and get_draw_attrs need not check that. */
+  auto is_plain_ascii = [&](text_pos_t pos) {
+    if (!can_draw_ascii || !is_printable_ascii(buffer_data[pos])) {
+      return false;
+    }
+    if (static_cast<size_t>(pos + 1) == buffer_size) {
+      return true;
+    }
+    const unsigned char next = static_cast<unsigned char>(
+        static_cast<size_t>(pos + 1) < data.size() ? buffer_data[pos + 1]
+                                                   : impl->view_at(pos + 1)[pos + 1]);
+    return next != 0 && next < 0x80;
+  };
+  /* Same as get_draw_attrs, but skips the expensive checks where possible. */
+  auto char_attrs = [&](text_pos_t pos) {
+    if (pos == info.cursor || !is_plain_ascii(pos)) {
+      return get_draw_attrs(pos, info);
+    }
+    t3_attr_t base_attr = get_base_attr(pos, info);
+    return pos >= info.selection_start && pos < info.selection_end ? info.selected_attr : base_attr;
+  };
+  /* Paint the bytes from start up to end, which may span multiple views. */
+  auto paint_bytes = [&](text_pos_t start, text_pos_t end, t3_attr_t attr) {
+    while (start < end) {
+      const string_view part = impl->view_at(start);
+      const text_pos_t part_end = std::min<text_pos_t>(end, part.size());
+      paint_part(win, part.data() + start, part_end - start, true, attr);
+      start = part_end;
+    }
+  };
+
+  text_pos_t i = info.start;
+  /* Skip most of the characters left of the window in long lines. Tabs are counted as control
+     characters for a tab size of 0. */
+  if (info.start == 0 && info.leftcol > 0) {
+    find_column_checkpoint(info.max, info.leftcol,
+                           (flags & text_line_t::TAB_AS_CONTROL) ? 0 : info.tabsize, &i, &total);
+  }
+  for (; static_cast<size_t>(i) < buffer_size && i < info.max && total < info.leftcol;
+       i += char_bytes(i)) {
+    advance_view(i);
+    if (char_width(i) != 0) {
+      selection_attr = char_attrs(i);
     }
 
     if (buffer_data[i] == '\t' && !(flags & text_line_t::TAB_AS_CONTROL)) {
@@ -364,15 +1148,15 @@ void text_line_t::paint_line(t3window::window_t *win, const text_line_t::paint_i
         win->addch(control_map[static_cast<int>(buffer_data[i])],
                    t3_term_combine_attrs(attributes.non_print, selection_attr));
       }
-    } else if (width_at(i) > 1) {
-      total += width_at(i);
+    } else if (char_width(i) > 1) {
+      total += char_width(i);
       if (total > info.leftcol) {
         for (text_pos_t j = info.leftcol; j < total; j++) {
           win->addch('<', t3_term_combine_attrs(attributes.non_print, selection_attr));
         }
       }
     } else {
-      total += width_at(i);
+      total += char_width(i);
     }
   }
 
@@ -384,47 +1168,83 @@ void text_line_t::paint_line(t3window::window_t *win, const text_line_t::paint_i
     print_from = i;
 
     /* Find the first non-zero-width char, and paint all zero-width chars now. */
-    while (static_cast<size_t>(i) < buffer_size && i < info.max && width_at(i) == 0) {
-      i += byte_width_from_first(i);
+    while (static_cast<size_t>(i) < buffer_size && i < info.max && char_width(i) == 0) {
+      i += char_bytes(i);
     }
 
     /* Note that non-printable characters will be discarded by libt3window. Thus
        we don't have to filter for them here. */
-    paint_part(win, buffer_data + print_from, i - print_from, true,
-               t3_term_combine_attrs(attributes.non_print, selection_attr));
+    paint_bytes(print_from, i, t3_term_combine_attrs(attributes.non_print, selection_attr));
     total++;
   } else {
     /* Skip to first non-zero-width char */
-    while (static_cast<size_t>(i) < buffer_size && i < info.max && width_at(i) == 0) {
-      i += byte_width_from_first(i);
+    while (static_cast<size_t>(i) < buffer_size && i < info.max && char_width(i) == 0) {
+      i += char_bytes(i);
     }
   }
 
-  _is_print = is_print(i);
+  _is_print = char_is_print(i);
   print_from = i;
   new_selection_attr = selection_attr;
-  for (; static_cast<size_t>(i) < buffer_size && i < info.max && total + accumulated < size;
-       i += byte_width_from_first(i)) {
-    if (width_at(i) != 0) {
-      new_selection_attr = get_draw_attrs(i, info);
+  /* Paint the characters from print_from up to i, which are either all printable or all not
+     printable, in which case they are painted as accumulated dots. */
+  auto paint_pending = [&]() {
+    if (_is_print) {
+      paint_bytes(print_from, i, selection_attr);
+    } else {
+      paint_part(win, nullptr, accumulated, false, selection_attr);
+    }
+  };
+  const text_pos_t paint_end = std::min<text_pos_t>(info.max, buffer_size);
+  while (i < paint_end && total + accumulated < size) {
+    advance_view(i);
+    if (_is_print && is_plain_ascii(i)) {
+      /* Fast path for runs of printable ASCII characters, which are split into spans with equal
+         attributes. Each span is painted with a single call. The cursor and the last character
+         of the run, which may be followed by a zero-width character, use the general code. */
+      text_pos_t run_end =
+          i + std::min<text_pos_t>(
+                  printable_ascii_run(buffer_data + i,
+                                      std::min<text_pos_t>(paint_end, data.size()) - i) -
+                      1,
+                  size - total - accumulated);
+      if (info.cursor >= i && info.cursor < run_end) {
+        run_end = info.cursor;
+      }
+      for (; i < run_end; ++i) {
+        new_selection_attr = char_attrs(i);
+        if (new_selection_attr != selection_attr) {
+          paint_bytes(print_from, i, selection_attr);
+          total += accumulated;
+          accumulated = 0;
+          print_from = i;
+          selection_attr = new_selection_attr;
+        }
+        accumulated++;
+      }
+      if (i >= paint_end || total + accumulated >= size) {
+        break;
+      }
+    }
+
+    if (char_width(i) != 0) {
+      new_selection_attr = char_attrs(i);
     }
 
     /* If selection changed between this char and the previous, print what
        we had so far. */
     if (new_selection_attr != selection_attr) {
-      paint_part(win, buffer_data + print_from, _is_print ? i - print_from : accumulated, _is_print,
-                 selection_attr);
+      paint_pending();
       total += accumulated;
       accumulated = 0;
       print_from = i;
     }
     selection_attr = new_selection_attr;
 
-    new_is_print = is_print(i);
+    new_is_print = char_is_print(i);
     if (buffer_data[i] == '\t' && !(flags & text_line_t::TAB_AS_CONTROL)) {
       /* Calculate the correct number of spaces for a tab character. */
-      paint_part(win, buffer_data + print_from, _is_print ? i - print_from : accumulated, _is_print,
-                 selection_attr);
+      paint_pending();
       total += accumulated;
       accumulated = 0;
       tabspaces = info.tabsize - (total % info.tabsize);
@@ -456,8 +1276,7 @@ void text_line_t::paint_line(t3window::window_t *win, const text_line_t::paint_i
       print_from = i + 1;
     } else if (static_cast<unsigned char>(buffer_data[i]) < 32) {
       /* Print control characters as ^ followed by a letter indicating the control char. */
-      paint_part(win, buffer_data + print_from, _is_print ? i - print_from : accumulated, _is_print,
-                 selection_attr);
+      paint_pending();
       total += accumulated;
       accumulated = 0;
       win->addch('^', t3_term_combine_attrs(attributes.non_print, selection_attr));
@@ -470,27 +1289,26 @@ void text_line_t::paint_line(t3window::window_t *win, const text_line_t::paint_i
     } else if (_is_print != new_is_print) {
       /* Print part of the buffer as either printable or control characters, because
          the next character is in the other category. */
-      paint_part(win, buffer_data + print_from, _is_print ? i - print_from : accumulated, _is_print,
-                 selection_attr);
+      paint_pending();
       total += accumulated;
-      accumulated = width_at(i);
+      accumulated = char_width(i);
       print_from = i;
     } else {
       /* Take care of double width characters that cross the right screen edge. */
-      if (total + accumulated + width_at(i) > size) {
+      if (total + accumulated + char_width(i) > size) {
         endchars = (size - total + accumulated);
         break;
       }
-      accumulated += width_at(i);
+      accumulated += char_width(i);
     }
     _is_print = new_is_print;
+    i += char_bytes(i);
   }
-  while (static_cast<size_t>(i) < buffer_size && i < info.max && width_at(i) == 0) {
-    i += byte_width_from_first(i);
+  while (static_cast<size_t>(i) < buffer_size && i < info.max && char_width(i) == 0) {
+    i += char_bytes(i);
   }
 
-  paint_part(win, buffer_data + print_from, _is_print ? i - print_from : accumulated, _is_print,
-             selection_attr);
+  paint_pending();
   total += accumulated;
 
   if ((flags & text_line_t::PARTIAL_CHAR) && i >= info.max) {
@@ -545,14 +1363,21 @@ text_line_t::break_pos_t text_line_t::find_next_break_pos(text_pos_t start, text
     total++;
   }
 
-  const size_t buffer_size = impl->buffer.size();
-  const char *buffer_data = impl->buffer.data();
+  const size_t buffer_size = size();
+  /* The view is advanced when the position reaches its end (see implementation_t::view_at). */
+  string_view data = impl->view_at(start);
+  /* For lines with only printable ASCII characters, each byte is a character of width 1. */
+  const bool simple = impl->is_simple_ascii();
   for (i = start; static_cast<size_t>(i) < buffer_size && total < length;
-       i = adjust_position(i, 1)) {
+       i = simple ? i + 1 : adjust_position(i, 1)) {
+    if (static_cast<size_t>(i) >= data.size()) {
+      data = impl->view_at(i);
+    }
+    const char *buffer_data = data.data();
     if (buffer_data[i] == '\t') {
       total += tabsize > 0 ? tabsize - (total % tabsize) : 2;
     } else {
-      total += width_at(i);
+      total += simple ? 1 : width_at(i);
     }
 
     if (total > length) {
@@ -562,7 +1387,7 @@ text_line_t::break_pos_t text_line_t::find_next_break_pos(text_pos_t start, text
       break;
     }
 
-    int cclass = get_class(impl->buffer, i);
+    int cclass = get_class(data, i);
     if (buffer_data[i] < 32 && (buffer_data[i] != '\t' || tabsize == 0)) {
       cclass = CLASS_GRAPH;
     }
@@ -574,7 +1399,7 @@ text_line_t::break_pos_t text_line_t::find_next_break_pos(text_pos_t start, text
       }
       possible_break.pos = i;
     } else if (cclass == CLASS_WHITESPACE && last_was_graph) {
-      possible_break.pos = adjust_position(i, 1);
+      possible_break.pos = simple ? i + 1 : adjust_position(i, 1);
       last_was_graph = false;
     } else if (cclass == CLASS_ALNUM || cclass == CLASS_GRAPH) {
       last_was_graph = true;
@@ -593,26 +1418,32 @@ text_line_t::break_pos_t text_line_t::find_next_break_pos(text_pos_t start, text
   return possible_break;
 }
 
+/* The word motion functions below only consider cursor positions, i.e. positions reachable with
+   adjust_position. These are the positions described by the class runs, which allows skipping
+   a whole run at once. */
 text_pos_t text_line_t::get_next_word(text_pos_t start) const {
   text_pos_t i;
-  int cclass, newCclass;
+  int cclass;
 
   if (start < 0) {
     start = 0;
     cclass = CLASS_WHITESPACE;
   } else {
-    cclass = get_class(impl->buffer, start);
+    cclass = get_class(impl->view_at(start), start);
     start = adjust_position(start, 1);
   }
 
-  for (i = start;
-       static_cast<size_t>(i) < impl->buffer.size() &&
-       ((newCclass = get_class(impl->buffer, i)) == cclass || newCclass == CLASS_WHITESPACE);
-       i = adjust_position(i, 1)) {
+  for (i = start; i < size();) {
+    size_t run = impl->class_run_at(i);
+    int newCclass = impl->class_run_class(run);
+    if (newCclass != cclass && newCclass != CLASS_WHITESPACE) {
+      break;
+    }
     cclass = newCclass;
+    i = impl->class_run_end(run);
   }
 
-  return static_cast<size_t>(i) >= impl->buffer.size() ? -1 : i;
+  return i >= size() ? -1 : i;
 }
 
 text_pos_t text_line_t::get_previous_word(text_pos_t start) const {
@@ -621,41 +1452,39 @@ text_pos_t text_line_t::get_previous_word(text_pos_t start) const {
   }
 
   if (start < 0) {
-    start = impl->buffer.size();
-  }
-
-  text_pos_t i;
-  int cclass = CLASS_WHITESPACE;
-  for (i = adjust_position(start, -1);
-       i > 0 && (cclass = get_class(impl->buffer, i)) == CLASS_WHITESPACE;
-       i = adjust_position(i, -1)) {
+    start = size();
   }
 
-  if (i == 0 && cclass == CLASS_WHITESPACE) {
+  text_pos_t i = adjust_position(start, -1);
+  if (i == 0) {
     return -1;
   }
 
-  text_pos_t savePos = i;
-
-  for (i = adjust_position(i, -1); i > 0 && get_class(impl->buffer, i) == cclass;
-       i = adjust_position(i, -1)) {
-    savePos = i;
-  }
-
-  if (i == 0 && get_class(impl->buffer, i) == cclass) {
-    savePos = i;
+  size_t run = impl->class_run_at(i);
+  if (impl->class_run_class(run) == CLASS_WHITESPACE) {
+    /* Skip the whitespace before start. */
+    if (impl->class_run_start(run) == 0) {
+      return -1;
+    }
+    i = adjust_position(impl->class_run_start(run), -1);
+    if (i == 0) {
+      return -1;
+    }
+    run = impl->class_run_at(i);
   }
 
-  return cclass != CLASS_WHITESPACE ? savePos : -1;
+  return impl->class_run_start(run);
 }
 
 text_pos_t text_line_t::get_next_word_boundary(text_pos_t start) const {
-  int cclass = get_class(impl->buffer, start);
+  int cclass = get_class(impl->view_at(start), start);
 
-  text_pos_t i;
-  for (i = adjust_position(start, 1);
-       static_cast<size_t>(i) < impl->buffer.size() && get_class(impl->buffer, i) == cclass;
-       i = adjust_position(i, 1)) {
+  text_pos_t i = adjust_position(start, 1);
+  if (i < size()) {
+    size_t run = impl->class_run_at(i);
+    if (impl->class_run_class(run) == cclass) {
+      i = impl->class_run_end(run);
+    }
   }
 
   return i;
@@ -666,20 +1495,15 @@ text_pos_t text_line_t::get_previous_word_boundary(text_pos_t start) const {
     return 0;
   }
 
-  int cclass = get_class(impl->buffer, start);
-  text_pos_t savePos = start;
+  int cclass = get_class(impl->view_at(start), start);
 
-  text_pos_t i;
-  for (i = adjust_position(start, -1); i > 0 && get_class(impl->buffer, i) == cclass;
-       i = adjust_position(i, -1)) {
-    savePos = i;
-  }
-
-  if (i == 0 && get_class(impl->buffer, i) == cclass) {
-    return 0;
+  text_pos_t i = adjust_position(start, -1);
+  if (i == 0) {
+    return get_class(impl->view_at(0), 0) == cclass ? 0 : start;
   }
 
-  return savePos;
+  size_t run = impl->class_run_at(i);
+  return impl->class_run_class(run) == cclass ? impl->class_run_start(run) : start;
 }
 
 /* Insert character 'c' into 'line' at position 'pos' */
@@ -689,8 +1513,6 @@ bool text_line_t::insert_char(text_pos_t pos, key_t c, undo_t *undo) {
 
   conversion_length = t3_utf8_put(c, conversion_buffer);
 
-  reserve(impl->buffer.size() + conversion_length + 1);
-
   if (undo != nullptr) {
     tiny_string_t *undo_text = undo->get_text();
     undo_text->reserve(undo_text->size() + conversion_length);
@@ -703,7 +1525,7 @@ bool text_line_t::insert_char(text_pos_t pos, key_t c, undo_t *undo) {
     impl->starts_with_combining = key_width(c) == 0;
   }
 
-  impl->buffer.insert(pos, conversion_buffer, conversion_length);
+  impl->replace(pos, 0, string_view(conversion_buffer, conversion_length));
   return true;
 }
 
@@ -735,18 +1557,14 @@ bool text_line_t::overwrite_char(text_pos_t pos, key_t c, undo_t *undo) {
   }
 
   oldspace = adjust_position(pos, 1) - pos;
-  if (static_cast<size_t>(oldspace) < conversion_length) {
-    reserve(impl->buffer.size() + conversion_length - oldspace);
-  }
-
   if (undo != nullptr) {
     ASSERT(undo->get_type() == UNDO_OVERWRITE);
     double_string_adapter_t undo_adapter(undo->get_text());
-    undo_adapter.append_first(string_view(impl->buffer.data() + pos, oldspace));
+    undo_adapter.append_first(impl->prefix(pos + oldspace).substr(pos, oldspace));
     undo_adapter.append_second(string_view(conversion_buffer, conversion_length));
   }
 
-  impl->buffer.replace(pos, oldspace, conversion_buffer, conversion_length);
+  impl->replace(pos, oldspace, string_view(conversion_buffer, conversion_length));
   return true;
 }
 
@@ -754,7 +1572,7 @@ bool text_line_t::overwrite_char(text_pos_t pos, key_t c, undo_t *undo) {
 bool text_line_t::delete_char(text_pos_t pos, undo_t *undo) {
   text_pos_t oldspace;
 
-  if (pos < 0 || static_cast<size_t>(pos) >= impl->buffer.size()) {
+  if (pos < 0 || pos >= size()) {
     return false;
   }
 
@@ -770,27 +1588,27 @@ bool text_line_t::delete_char(text_pos_t pos, undo_t *undo) {
 
     ASSERT(undo->get_type() == UNDO_DELETE || undo->get_type() == UNDO_BACKSPACE);
     undo_text->insert(undo->get_type() == UNDO_DELETE ? undo_text->size() : 0,
-                      string_view(impl->buffer.data() + pos, oldspace));
+                      impl->prefix(pos + oldspace).substr(pos, oldspace));
   }
 
-  impl->buffer.erase(pos, oldspace);
+  impl->replace(pos, oldspace, string_view());
   return true;
 }
 
 /* Append character 'c' to 'line' */
 bool text_line_t::append_char(key_t c, undo_t *undo) {
-  return insert_char(impl->buffer.size(), c, undo);
+  return insert_char(size(), c, undo);
 }
 
 /* Backspace word at 'pos' */
 bool text_line_t::backspace_word(text_pos_t pos, text_pos_t newpos, undo_t *undo) {
   text_pos_t oldspace;
 
-  if (pos < 0 || static_cast<size_t>(pos) > impl->buffer.size()) {
+  if (pos < 0 || pos > size()) {
     return false;
   }
 
-  if (newpos < 0 || static_cast<size_t>(newpos) > impl->buffer.size()) {
+  if (newpos < 0 || newpos > size()) {
     return false;
   }
 
@@ -803,10 +1621,10 @@ bool text_line_t::backspace_word(text_pos_t pos, text_pos_t newpos, undo_t *undo
     tiny_string_t *undo_text = undo->get_text();
     undo_text->reserve(oldspace);
     ASSERT(undo->get_type() == UNDO_BACKSPACE);
-    undo_text->insert(0, string_view(impl->buffer.data() + newpos, oldspace));
+    undo_text->insert(0, impl->prefix(pos).substr(newpos, oldspace));
   }
 
-  impl->buffer.erase(newpos, oldspace);
+  impl->replace(newpos, oldspace, string_view());
 
   return true;
 }
@@ -849,12 +1667,37 @@ text_pos_t text_line_t::adjust_position(string_view str, text_pos_t pos, int adj
 }
 
 text_pos_t text_line_t::adjust_position(text_pos_t pos, int adjust) const {
-  return adjust_position(impl->buffer, pos, adjust);
+  /* This is the same as the static version, but reads the line through the character functions
+     below, such that the gap of a line being edited is not moved. */
+  const text_pos_t line_size = size();
+  auto previous_char = [&](text_pos_t pos) {
+    do {
+      pos--;
+    } while (pos > 0 && (impl->view_at(pos)[pos] & 0xc0) == 0x80);
+    return pos;
+  };
+  if (adjust > 0) {
+    for (; adjust > 0 && pos < line_size; adjust -= (width_at(pos) ? 1 : 0)) {
+      pos += byte_width_from_first(pos);
+    }
+  } else if (adjust < 0) {
+    for (; adjust < 0 && pos > 0; adjust += (width_at(pos) ? 1 : 0)) {
+      pos = previous_char(pos);
+    }
+  } else {
+    while (pos > 0 && width_at(pos) == 0) {
+      pos = previous_char(pos);
+    }
+  }
+  return pos;
 }
 
-text_pos_t text_line_t::size() const { return impl->buffer.size(); }
+text_pos_t text_line_t::size() const { return impl->size(); }
 
 int text_line_t::byte_width_from_first(string_view str, text_pos_t pos) {
+  if (static_cast<size_t>(pos) >= str.size()) {
+    return 1;
+  }
   switch (str[pos] & 0xF0) {
     case 0xF0:
       return 4;
@@ -869,10 +1712,13 @@ int text_line_t::byte_width_from_first(string_view str, text_pos_t pos) {
 }
 
 int text_line_t::byte_width_from_first(text_pos_t pos) const {
-  return byte_width_from_first(impl->buffer, pos);
+  return byte_width_from_first(impl->view_at(pos), pos);
 }
 
 int text_line_t::key_width(key_t key) {
+  if (key >= 0) {
+    return get_char_info(static_cast<uint32_t>(key)) & CHAR_INFO_WIDTH_MASK;
+  }
   int width = t3_utf8_wcwidth(static_cast<uint32_t>(key));
   if (width < 0) {
     width = key < 32 && key != '\t' ? 2 : 1;
@@ -882,7 +1728,8 @@ int text_line_t::key_width(key_t key) {
 
 int text_line_t::width_at(string_view str, text_pos_t pos) {
   const char *buffer_data = str.data();
-  uint32_t c = t3_utf8_get(buffer_data + pos, nullptr);
+  /* str need not be nul-terminated, so treat the end of the string as a nul character. */
+  uint32_t c = static_cast<size_t>(pos) < str.size() ? t3_utf8_get(buffer_data + pos, nullptr) : 0;
   if (is_conjoining_jamo_t(c) && pos > 0) {
     do {
       pos--;
@@ -912,24 +1759,80 @@ int text_line_t::width_at(string_view str, text_pos_t pos) {
   return key_width(c);
 }
 
-int text_line_t::width_at(text_pos_t pos) const { return width_at(impl->buffer, pos); }
+int text_line_t::width_at(text_pos_t pos) const {
+  const string_view data = impl->view_at(pos);
+  /* Conjoining Jamo vowels and trailing consonants (encoded starting with 0xE1) depend on the
+     preceding characters, which must then be readable as well. */
+  if (static_cast<size_t>(pos) < data.size() && static_cast<unsigned char>(data[pos]) == 0xe1) {
+    return width_at(impl->view_at(pos, 6), pos);
+  }
+  return width_at(data, pos);
+}
 
 bool text_line_t::is_print(text_pos_t pos) const {
-  return impl->buffer[pos] == '\t' ||
-         !uc_is_general_category_withtable(t3_utf8_get(impl->buffer.data() + pos, nullptr),
-                                           T3_UTF8_CONTROL_MASK);
+  /* Lines backed by a file mapping are not nul-terminated, so the end of the line is handled
+     explicitly. */
+  if (pos >= size()) {
+    return false;
+  }
+  const string_view data = impl->view_at(pos);
+  return data[pos] == '\t' ||
+         !(get_char_info(t3_utf8_get(data.data() + pos, nullptr)) & CHAR_INFO_CONTROL);
 }
 bool text_line_t::is_alnum(text_pos_t pos) const {
-  return get_class(impl->buffer, pos) == CLASS_ALNUM;
+  return get_class(impl->view_at(pos), pos) == CLASS_ALNUM;
 }
 bool text_line_t::is_space(text_pos_t pos) const {
-  return get_class(impl->buffer, pos) == CLASS_WHITESPACE;
+  return get_class(impl->view_at(pos), pos) == CLASS_WHITESPACE;
 }
 bool text_line_t::is_bad_draw(text_pos_t pos) const {
-  return !t3_term_can_draw(impl->buffer.data() + pos, (adjust_position(pos, 1) - pos));
+  const text_pos_t end = adjust_position(pos, 1);
+  const string_view data = impl->view_at(pos);
+  if (static_cast<size_t>(end) > data.size()) {
+    /* The character is followed by zero-width characters on the other side of the gap, so the
+       bytes are copied to make them contiguous. */
+    std::string bytes(data.data() + pos, data.size() - pos);
+    bytes.append(impl->view_at(data.size()).data() + data.size(), end - data.size());
+    return !t3_term_can_draw(bytes.data(), bytes.size());
+  }
+  return !t3_term_can_draw(data.data() + pos, end - pos);
 }
 
-const std::string &text_line_t::get_data() const { return impl->buffer; }
+text_pos_t text_line_t::get_gap_position() const {
+  return impl->buffer == nullptr ? -1 : impl->gap_start;
+}
+
+const std::string *text_line_t::get_string_data() const {
+  if (impl->buffer != nullptr) {
+    impl->close_gap();
+    return impl->buffer.get();
+  }
+  if (impl->shared != nullptr && impl->external.data() == impl->shared->data() &&
+      impl->external.size() == impl->shared->size()) {
+    return impl->shared.get();
+  }
+  return nullptr;
+}
+
+std::string text_line_t::get_data() const {
+  const string_view contents = impl->data();
+  return std::string(contents.data(), contents.size());
+}
+
+string_view text_line_t::get_view() const { return impl->data(); }
+
+void text_line_t::set_external_data(string_view data) {
+  impl->release_buffer();
+  impl->shared.reset();
+  impl->compact = tiny_string_t();
+  impl->external = data;
+  impl->invalidate_metadata();
+  impl->starts_with_combining = size() > 0 && width_at(0) == 0;
+}
+
+void text_line_t::set_generation(uint64_t generation) { impl->generation = generation; }
+
+uint64_t text_line_t::get_generation() const { return impl->generation; }
 
 void text_line_t::init() {
   memset(spaces, ' ', sizeof(spaces));
@@ -938,15 +1841,25 @@ void text_line_t::init() {
   if (!t3_term_can_draw(wrap_symbol, strlen(wrap_symbol))) {
     wrap_symbol = "$";
   }
+
+  char printable_ascii[0x7f - 0x20];
+  for (size_t i = 0; i < sizeof(printable_ascii); ++i) {
+    printable_ascii[i] = static_cast<char>(0x20 + i);
+  }
+  can_draw_ascii = t3_term_can_draw(printable_ascii, sizeof(printable_ascii));
 }
 
-void text_line_t::reserve(text_pos_t size) { impl->buffer.reserve(size); }
+void text_line_t::reserve(text_pos_t size) {
+  /* Reserving space does not change the contents, so the metadata remains valid. */
+  impl->materialize();
+  impl->buffer->reserve(size + impl->gap_size);
+}
 
 bool text_line_t::check_boundaries(text_pos_t match_start, text_pos_t match_end) const {
-  return (match_start == 0 || get_class(impl->buffer, match_start) !=
-                                  get_class(impl->buffer, adjust_position(match_start, -1))) &&
-         (match_end == size() || get_class(impl->buffer, match_end) !=
-                                     get_class(impl->buffer, adjust_position(match_end, 1)));
+  return (match_start == 0 || get_class(impl->data(), match_start) !=
+                                  get_class(impl->data(), adjust_position(match_start, -1))) &&
+         (match_end == size() || get_class(impl->data(), match_end) !=
+                                     get_class(impl->data(), adjust_position(match_end, 1)));
 }
 
 text_line_factory_t *text_line_t::get_line_factory() const { return impl->factory; }
@@ -954,12 +1867,18 @@ text_line_factory_t *text_line_t::get_line_factory() const { return impl->factor
 //============================= text_line_factory_t ========================
 
 text_line_factory_t::text_line_factory_t() {}
+text_line_factory_t::text_line_factory_t(bool use_arena) {
+  if (use_arena) {
+    arena.reset(new text_line_arena_t);
+  }
+}
 text_line_factory_t::~text_line_factory_t() {}
 std::unique_ptr<text_line_t> text_line_factory_t::new_text_line_t(int buffersize) {
-  return t3widget::make_unique<text_line_t>(buffersize, this);
+  return std::unique_ptr<text_line_t>(new (get_arena()) text_line_t(buffersize, this));
 }
 std::unique_ptr<text_line_t> text_line_factory_t::new_text_line_t(string_view _buffer) {
-  return t3widget::make_unique<text_line_t>(_buffer, this);
+  return std::unique_ptr<text_line_t>(new (get_arena()) text_line_t(_buffer, this));
 }
+text_line_arena_t *text_line_factory_t::get_arena() const { return arena.get(); }
 
 }  // namespace t3widget
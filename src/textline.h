@@ -17,6 +17,9 @@
 #define BUFFERSIZE 64
 #define BUFFERINC 16
 
+#include <cstddef>
+#include <cstdint>
+#include <memory>
 #include <stdio.h>
 #include <string>
 #include <sys/types.h>
@@ -33,6 +36,7 @@ class undo_t;
 #define _T3_MAX_TAB 80
 
 class text_line_factory_t;
+class text_line_arena_t;
 
 class T3_WIDGET_API text_line_t {
  public:
@@ -94,8 +98,20 @@ class T3_WIDGET_API text_line_t {
 
   void reserve(text_pos_t size);
   int byte_width_from_first(text_pos_t pos) const;
+  void add_screen_width(text_pos_t *pos, text_pos_t end, text_pos_t *total, int tabsize) const;
+  void find_column_checkpoint(text_pos_t max_pos, text_pos_t max_column, int tabsize,
+                              text_pos_t *pos, text_pos_t *column) const;
+
+  /* Make the line refer to bytes stored outside the line, such as in a file mapping. These must be
+     valid UTF-8 and must outlive the line (or until the line is modified). */
+  void set_external_data(string_view data);
+
+  /* Sequence number of the last change of the containing text_buffer_t that affected the line. */
+  void set_generation(uint64_t generation);
+  uint64_t get_generation() const;
 
   friend class regex_finder_t;
+  friend class text_buffer_t;
 
  protected:
   text_line_factory_t *get_line_factory() const;
@@ -106,6 +122,14 @@ class T3_WIDGET_API text_line_t {
   text_line_t(string_view buffer, text_line_factory_t *factory = nullptr);
   virtual ~text_line_t();
 
+  /** Allocate a text_line_t (or derived class) on the heap. */
+  static void *operator new(std::size_t size);
+  /** Allocate a text_line_t (or derived class) in @p arena, or on the heap if @p arena is
+      @c nullptr. See text_line_factory_t::get_arena. */
+  static void *operator new(std::size_t size, text_line_arena_t *arena);
+  static void operator delete(void *ptr, std::size_t size);
+  static void operator delete(void *ptr, text_line_arena_t *arena);
+
   void set_text(string_view _buffer);
 
   void merge(std::unique_ptr<text_line_t> other);
@@ -142,8 +166,21 @@ class T3_WIDGET_API text_line_t {
   bool is_space(text_pos_t pos) const;
   bool is_alnum(text_pos_t pos) const;
   bool is_bad_draw(text_pos_t pos) const;
-
-  const std::string &get_data() const;
+  /** Get the position of the gap in the buffer of a line that is being edited, or -1 if the line
+      has no such buffer. Only intended for testing which operations rearrange the buffer. */
+  T3_WIDGET_LOCAL text_pos_t get_gap_position() const;
+
+  /** Get a copy of the contents of the line. Use get_view if read-only access suffices. */
+  std::string get_data() const;
+  /** Get the @c std::string holding the contents of the line, or @c nullptr if the contents are
+      not stored in a single @c std::string. The result is valid until the line is modified. */
+  const std::string *get_string_data() const;
+  /** Get a read-only view of the contents of the line, which is valid until the line is modified.
+      Note that the view is not nul-terminated.
+
+      After a modification, the first call rearranges the buffer of the line to make the contents
+      contiguous. Only subsequent calls are safe to make from multiple threads. */
+  string_view get_view() const;
 
   text_pos_t get_next_word_boundary(text_pos_t start) const;
   text_pos_t get_previous_word_boundary(text_pos_t start) const;
@@ -152,11 +189,28 @@ class T3_WIDGET_API text_line_t {
 };
 
 class T3_WIDGET_API text_line_factory_t {
+ private:
+  std::unique_ptr<text_line_arena_t> arena;
+
  public:
   text_line_factory_t();
+  /** Create a new text_line_factory_t, optionally allocating lines from an arena.
+      @param use_arena Allocate lines from an arena owned by this factory.
+
+      When using an arena, lines and the unmodified text of lines are allocated from large blocks
+      of memory, which reduces the number of allocations and improves locality. Memory is only
+      returned to the system when the factory is destroyed, which must happen after all lines
+      created by it have been destroyed. It is therefore best to use a separate factory for each
+      text_buffer_t. Lines and the memory of the arena may be allocated from multiple threads. */
+  explicit text_line_factory_t(bool use_arena);
   virtual ~text_line_factory_t();
   virtual std::unique_ptr<text_line_t> new_text_line_t(int buffersize = BUFFERSIZE);
   virtual std::unique_ptr<text_line_t> new_text_line_t(string_view _buffer);
+
+  /** Get the arena used by this factory, or @c nullptr if it doesn't use one.
+      Derived classes can pass this to the placement new operator of text_line_t to allocate
+      their lines in the arena. */
+  text_line_arena_t *get_arena() const;
 };
 
 T3_WIDGET_API extern text_line_factory_t default_text_line_factory;
@@ -0,0 +1,245 @@
+/* Copyright (C) 2018 G.P. Halkes
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License version 3, as
+   published by the Free Software Foundation.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include "t3widget/textloader.h"
+
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <thread>
+#include <unistd.h>
+#include <utility>
+#include <vector>
+
+#include "t3widget/internal.h"
+#include "t3widget/key.h"
+#include "t3widget/main.h"
+#include "t3widget/signals.h"
+#include "t3widget/textbuffer_impl.h"
+#include "t3widget/textline.h"
+
+namespace t3widget {
+
+/* Number of bytes read from the file in one go. */
+static const size_t chunk_size = 65536;
+
+struct text_loader_t::implementation_t {
+  /* Complete lines read from a single chunk of the file. The lines are found on the loading
+     thread, but the text_line_t objects are created by process_chunks, because the
+     text_line_factory_t of the text need not be safe to use from multiple threads. The first line
+     is to be merged with the last line of the text. */
+  struct chunk_t {
+    std::string data;
+    /* Offsets of the newlines in data. The last line runs from the last newline to the end of
+       data, and is empty unless this is the last chunk. */
+    std::vector<size_t> newlines;
+    text_pos_t bytes_read;
+  };
+
+  text_buffer_t *text;
+  text_line_factory_t *line_factory;
+  int fd = -1;
+  text_pos_t file_size = -1;
+  std::thread read_thread;
+  std::atomic<bool> cancelled{false};
+  connection_t update_connection;
+
+  /* Protects the members below, which are shared with the loading thread. */
+  std::mutex chunks_lock;
+  std::vector<chunk_t> chunks;
+  bool done = false;
+  int error = 0;
+
+  signal_t<text_pos_t> lines_appended;
+  signal_t<text_pos_t, text_pos_t> progress;
+  signal_t<int> finished;
+
+  implementation_t(text_buffer_t *_text) : text(_text), line_factory(_text->impl->line_factory) {}
+
+  void read_file();
+  void publish(chunk_t chunk, bool is_last, int read_error);
+  std::vector<std::unique_ptr<text_line_t>> make_lines(const chunk_t &chunk);
+  void process_chunks();
+  void stop();
+};
+
+/* Runs on the loading thread. */
+void text_loader_t::implementation_t::read_file() {
+  std::unique_ptr<char[]> buffer(new char[chunk_size]);
+  std::string pending;
+  text_pos_t bytes_read = 0;
+  int read_error = 0;
+
+  while (!cancelled) {
+    ssize_t result = nosig_read(fd, buffer.get(), chunk_size);
+    if (result <= 0) {
+      if (result < 0) {
+        read_error = errno;
+      }
+      break;
+    }
+    bytes_read += result;
+    pending.append(buffer.get(), result);
+
+    /* Only complete lines are split off, such that multi-byte characters are never split. The
+       empty line following the last newline is included, to which the next chunk is merged. Only
+       the bytes just read are searched, as pending contains no newline before them. */
+    const size_t chunk_newline = string_view(buffer.get(), result).rfind('\n');
+    if (chunk_newline == string_view::npos) {
+      continue;
+    }
+    const size_t last_newline = pending.size() - result + chunk_newline;
+
+    chunk_t chunk;
+    chunk.bytes_read = bytes_read;
+    /* Hand the complete lines over to the chunk, and keep the start of the incomplete last line. */
+    std::string rest(pending, last_newline + 1);
+    pending.resize(last_newline + 1);
+    chunk.data.swap(pending);
+    pending.swap(rest);
+    const char *data = chunk.data.data();
+    const char *newline = data;
+    while ((newline = static_cast<const char *>(
+                memchr(newline, '\n', chunk.data.size() - (newline - data)))) != nullptr) {
+      chunk.newlines.push_back(newline - data);
+      ++newline;
+    }
+    publish(std::move(chunk), false, 0);
+  }
+
+  if (cancelled) {
+    return;
+  }
+
+  chunk_t chunk;
+  chunk.bytes_read = bytes_read;
+  chunk.data.swap(pending);
+  publish(std::move(chunk), true, read_error);
+}
+
+/* Runs on the loading thread. */
+void text_loader_t::implementation_t::publish(chunk_t chunk, bool is_last, int read_error) {
+  {
+    std::lock_guard<std::mutex> guard(chunks_lock);
+    chunks.push_back(std::move(chunk));
+    if (is_last) {
+      done = true;
+      error = read_error;
+    }
+  }
+  signal_update();
+}
+
+std::vector<std::unique_ptr<text_line_t>> text_loader_t::implementation_t::make_lines(
+    const chunk_t &chunk) {
+  std::vector<std::unique_ptr<text_line_t>> lines;
+  lines.reserve(chunk.newlines.size() + 1);
+  const string_view data(chunk.data);
+  size_t start = 0;
+  for (size_t newline : chunk.newlines) {
+    lines.push_back(line_factory->new_text_line_t(data.substr(start, newline - start)));
+    start = newline + 1;
+  }
+  lines.push_back(line_factory->new_text_line_t(data.substr(start)));
+  return lines;
+}
+
+void text_loader_t::implementation_t::process_chunks() {
+  std::vector<chunk_t> ready;
+  bool is_done;
+  int load_error;
+
+  {
+    std::lock_guard<std::mutex> guard(chunks_lock);
+    ready.swap(chunks);
+    is_done = done;
+    load_error = error;
+  }
+
+  for (chunk_t &chunk : ready) {
+    /* One of the callbacks may have cancelled loading. */
+    if (cancelled) {
+      return;
+    }
+    if (!chunk.data.empty()) {
+      lines_appended(text->impl->append_lines(make_lines(chunk)));
+    }
+    progress(chunk.bytes_read, file_size);
+  }
+
+  if (is_done && !cancelled) {
+    stop();
+    finished(load_error);
+  }
+}
+
+void text_loader_t::implementation_t::stop() {
+  cancelled = true;
+  if (read_thread.joinable()) {
+    read_thread.join();
+  }
+  if (fd >= 0) {
+    close(fd);
+    fd = -1;
+  }
+  update_connection.disconnect();
+  chunks.clear();
+  done = false;
+}
+
+text_loader_t::text_loader_t(text_buffer_t *text) : impl(new implementation_t(text)) {}
+
+text_loader_t::~text_loader_t() { impl->stop(); }
+
+int text_loader_t::start(const std::string &name) {
+  struct stat file_info;
+
+  if (is_loading()) {
+    return EBUSY;
+  }
+
+  if ((impl->fd = open(name.c_str(), O_RDONLY)) < 0) {
+    return errno;
+  }
+  if (fstat(impl->fd, &file_info) < 0) {
+    int saved_errno = errno;
+    close(impl->fd);
+    impl->fd = -1;
+    return saved_errno;
+  }
+
+  impl->file_size = S_ISREG(file_info.st_mode) ? file_info.st_size : -1;
+  impl->cancelled = false;
+  impl->error = 0;
+  impl->update_connection = connect_update_notification([this] { impl->process_chunks(); });
+  impl->read_thread = std::thread([this] { impl->read_file(); });
+  return 0;
+}
+
+void text_loader_t::cancel() { impl->stop(); }
+
+bool text_loader_t::is_loading() const { return impl->read_thread.joinable(); }
+
+void text_loader_t::process_chunks() { impl->process_chunks(); }
+
+_T3_WIDGET_IMPL_SIGNAL(text_loader_t, lines_appended, text_pos_t)
+_T3_WIDGET_IMPL_SIGNAL(text_loader_t, progress, text_pos_t, text_pos_t)
+_T3_WIDGET_IMPL_SIGNAL(text_loader_t, finished, int)
+
+}  // namespace t3widget
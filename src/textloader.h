@@ -0,0 +1,89 @@
+/* Copyright (C) 2018 G.P. Halkes
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License version 3, as
+   published by the Free Software Foundation.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef T3_WIDGET_TEXTLOADER_H
+#define T3_WIDGET_TEXTLOADER_H
+
+#include <string>
+#include <t3widget/signals.h>
+#include <t3widget/textbuffer.h>
+#include <t3widget/util.h>
+#include <t3widget/widget_api.h>
+
+namespace t3widget {
+
+/** Class for loading a file into a text_buffer_t in the background.
+
+    The file is read and split into lines on a separate thread. The completed lines are appended
+    to the text_buffer_t on the thread running the #main_loop function, in response to the
+    @c update_notification signal, such that the first part of the text can be displayed and
+    scrolled while the rest of the file is still being read. Each chunk read from the file is
+    appended in a single operation, for which the text_buffer_t emits a single
+    @c rewrap_required signal with type @c INSERT_LINES. The #lines_appended signal is emitted after
+    each such operation.
+
+    The lines are created with the text_line_factory_t of the text_buffer_t on the thread running
+    the #main_loop function, so the factory does not need to be safe to use from multiple threads.
+    The text_buffer_t should not be modified by other means while loading is in progress.
+*/
+class T3_WIDGET_API text_loader_t {
+ private:
+  struct T3_WIDGET_LOCAL implementation_t;
+  pimpl_t<implementation_t> impl;
+
+ public:
+  /** Create a new text_loader_t, which appends to @p text. */
+  text_loader_t(text_buffer_t *text);
+  /** Destroy the text_loader_t, cancelling the load operation if it is in progress. */
+  ~text_loader_t();
+
+  /** Start loading the file @p name.
+      @return 0 on success, or an @c errno value describing the error.
+
+      Errors that occur after the file has been opened are reported through the #finished signal.
+  */
+  int start(const std::string &name);
+  /** Stop loading.
+
+      Lines that have not been appended to the text yet are discarded, and the #finished signal is
+      not emitted. When the file is not a regular file, this may block until the read operation in
+      progress completes. */
+  void cancel();
+  /** Returns @c true if loading is in progress. */
+  bool is_loading() const;
+  /** Append the lines read so far, as is done in response to the @c update_notification signal.
+      Only intended for testing without running the #main_loop function. */
+  T3_WIDGET_LOCAL void process_chunks();
+
+  /** @fn connection_t connect_lines_appended(std::function<void(text_pos_t)> func)
+      Connect a callback to the #lines_appended signal.
+  */
+  /** Signal emitted after lines have been appended to the text. The parameter is the index of the
+      first line that changed. */
+  T3_WIDGET_DECLARE_SIGNAL(lines_appended, text_pos_t);
+  /** @fn connection_t connect_progress(std::function<void(text_pos_t, text_pos_t)> func)
+      Connect a callback to the #progress signal.
+  */
+  /** Signal emitted after lines have been appended to the text. The parameters are the number of
+      bytes read so far, and the size of the file in bytes (or -1 if unknown). */
+  T3_WIDGET_DECLARE_SIGNAL(progress, text_pos_t, text_pos_t);
+  /** @fn connection_t connect_finished(std::function<void(int)> func)
+      Connect a callback to the #finished signal.
+  */
+  /** Signal emitted when loading is complete. The parameter is 0 on success, or an @c errno value
+      describing the error. */
+  T3_WIDGET_DECLARE_SIGNAL(finished, int);
+};
+
+}  // namespace t3widget
+#endif
@@ -149,6 +149,7 @@ tiny_string_t &tiny_string_t::assign(tiny_string_t &&other) {
     std::free(ptr);
   }
   std::memcpy(bytes, other.bytes, sizeof(bytes));
+  other.mutable_signal_byte() = 1;
   return *this;
 }
 
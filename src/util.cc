@@ -11,6 +11,7 @@
    You should have received a copy of the GNU General Public License
    along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
+#include <atomic>
 #include <cerrno>
 #include <climits>
 #include <cstdint>
@@ -407,20 +408,73 @@ std::string convert_lang_codeset(string_view str, bool from) {
   }
 }
 
-int get_class(const std::string &str, text_pos_t pos) {
-  size_t data_len = str.size() - pos;
-  uint32_t c = t3_utf8_get(str.data() + pos, &data_len);
+static uint8_t compute_char_info(uint32_t c) {
+  int width = t3_utf8_wcwidth(c);
+  if (width < 0) {
+    width = c < 32 && c != '\t' ? 2 : 1;
+  }
 
+  int char_class;
   if (uc_is_property_id_continue(c)) {
-    return CLASS_ALNUM;
+    char_class = CLASS_ALNUM;
+  } else if (!uc_is_general_category_withtable(c, T3_UTF8_CONTROL_MASK | UC_CATEGORY_MASK_Zs)) {
+    char_class = CLASS_GRAPH;
+  } else if (c == '\t' || uc_is_general_category_withtable(c, UC_CATEGORY_MASK_Zs)) {
+    char_class = CLASS_WHITESPACE;
+  } else {
+    char_class = CLASS_OTHER;
   }
-  if (!uc_is_general_category_withtable(c, T3_UTF8_CONTROL_MASK | UC_CATEGORY_MASK_Zs)) {
-    return CLASS_GRAPH;
+
+  return (width & CHAR_INFO_WIDTH_MASK) | (char_class << CHAR_INFO_CLASS_SHIFT) |
+         (uc_is_general_category_withtable(c, T3_UTF8_CONTROL_MASK) ? CHAR_INFO_CONTROL : 0);
+}
+
+/* The character information is stored in a two-level table, with one block per 256 code points.
+   The blocks are filled on first use from libt3window and libunistring, such that the results
+   match the library versions in use, and only the blocks for the scripts actually encountered are
+   computed. Blocks are never freed. */
+static const uint32_t char_info_block_bits = 8;
+static const uint32_t char_info_limit = 0x110000;
+static std::atomic<const uint8_t *> char_info_blocks[char_info_limit >> char_info_block_bits];
+
+static const uint8_t *fill_char_info_block(uint32_t block_idx) {
+  const uint32_t block_size = 1 << char_info_block_bits;
+  uint8_t *block = new uint8_t[block_size];
+  for (uint32_t i = 0; i < block_size; ++i) {
+    block[i] = compute_char_info((block_idx << char_info_block_bits) + i);
   }
-  if (c == '\t' || uc_is_general_category_withtable(c, UC_CATEGORY_MASK_Zs)) {
-    return CLASS_WHITESPACE;
+
+  /* Another thread may have filled the same block in the mean time. */
+  const uint8_t *expected = nullptr;
+  if (!char_info_blocks[block_idx].compare_exchange_strong(expected, block,
+                                                           std::memory_order_acq_rel)) {
+    delete[] block;
+    return expected;
   }
-  return CLASS_OTHER;
+  return block;
+}
+
+uint8_t get_char_info(uint32_t c) {
+  if (c >= char_info_limit) {
+    return compute_char_info(c);
+  }
+  const uint32_t block_idx = c >> char_info_block_bits;
+  const uint8_t *block = char_info_blocks[block_idx].load(std::memory_order_acquire);
+  if (block == nullptr) {
+    block = fill_char_info_block(block_idx);
+  }
+  return block[c & ((1 << char_info_block_bits) - 1)];
+}
+
+int get_class(string_view str, text_pos_t pos) {
+  /* The data of a line need not be nul-terminated, so the end of the text is classified as if it
+     were the terminating nul character, without reading past the end. */
+  if (pos >= static_cast<text_pos_t>(str.size())) {
+    return (get_char_info(0) & CHAR_INFO_CLASS_MASK) >> CHAR_INFO_CLASS_SHIFT;
+  }
+  size_t data_len = str.size() - pos;
+  uint32_t c = t3_utf8_get(str.data() + pos, &data_len);
+  return (get_char_info(c) & CHAR_INFO_CLASS_MASK) >> CHAR_INFO_CLASS_SHIFT;
 }
 
 bool starts_with(const std::string &str, const std::string &with) {
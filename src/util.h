@@ -341,6 +341,9 @@ enum class rewrap_type_t { REWRAP_ALL, REWRAP_LINE, REWRAP_LINE_LOCAL, INSERT_LI
 
 enum class wrap_type_t { NONE, WORD, CHARACTER };
 
+/** Line endings to use when writing text to a file. */
+enum class line_ending_t { LF, CRLF };
+
 #undef _T3_WIDGET_ENUM
 
 struct free_deleter {
@@ -1018,7 +1018,7 @@ bool edit_window_t::process_key(key_t key) {
       const text_coordinate_t cursor = text->get_cursor();
       update_repaint_lines(cursor.line, std::numeric_limits<text_pos_t>::max());
       if (impl->auto_indent && !impl->pasting_text) {
-        const std::string &current_line = text->get_line_data(cursor.line).get_data();
+        const string_view current_line = text->get_line_data(cursor.line).get_view();
         text_pos_t i;
         for (i = 0, indent = 0, tabs = 0; i < cursor.pos; i++) {
           if (current_line[i] == '\t') {
@@ -1253,11 +1253,8 @@ void edit_window_t::update_contents() {
         std::max(text->size(), impl->top_left.line + impl->edit_window.get_height()),
         impl->top_left.line, impl->edit_window.get_height());
   } else {
-    text_pos_t count = 0;
-    for (text_pos_t i = 0; i < impl->top_left.line; i++) {
-      count += impl->wrap_info->get_line_count(i);
-    }
-    count += impl->top_left.pos;
+    text_pos_t count =
+        impl->wrap_info->get_rows_before(impl->top_left.line) + impl->top_left.pos;
 
     impl->scrollbar->set_parameters(
         std::max(impl->wrap_info->wrapped_size(), count + impl->edit_window.get_height()), count,
@@ -1508,6 +1505,10 @@ void edit_window_t::set_use_local_finder(bool _use_local_finder) {
   impl->use_local_finder = _use_local_finder;
 }
 
+void edit_window_t::lines_appended(text_pos_t first_line) {
+  update_repaint_lines(first_line, std::numeric_limits<text_pos_t>::max());
+}
+
 void edit_window_t::force_redraw() {
   update_repaint_lines(0, std::numeric_limits<text_pos_t>::max());
   draw_info_window();
@@ -1620,6 +1621,8 @@ void edit_window_t::set_wrap(wrap_type_t wrap) {
     // FIXME: differentiate between wrap types
     if (impl->wrap_info == nullptr) {
       impl->wrap_info = new wrap_info_t(impl->edit_window.get_width() - 1, impl->tabsize);
+      /* Only the scrollbar depends on lines wrapped in the background. */
+      impl->wrap_info->connect_rows_changed([this] { widget_t::force_redraw(); });
     }
     impl->wrap_info->set_text_buffer(text);
     impl->wrap_info->set_wrap_width(impl->edit_window.get_width() - 1);
@@ -1710,10 +1713,9 @@ void edit_window_t::activate_autocomplete(bool autocomplete_single) {
       if (cursor.line == impl->top_left.line) {
         line = sub_line - impl->top_left.pos;
       } else {
-        line = impl->wrap_info->get_line_count(impl->top_left.line) - impl->top_left.pos + sub_line;
-        for (text_pos_t i = impl->top_left.line + 1; i < cursor.line; i++) {
-          line += impl->wrap_info->get_line_count(i);
-        }
+        line = impl->wrap_info->get_rows_before(cursor.line) -
+               impl->wrap_info->get_rows_before(impl->top_left.line) - impl->top_left.pos +
+               sub_line;
       }
       impl->autocomplete_panel->set_position(line + 1, position - 1);
     }
@@ -1821,25 +1823,12 @@ void edit_window_t::scrollbar_dragged(text_pos_t start) {
       update_repaint_lines(0, std::numeric_limits<text_pos_t>::max());
     }
   } else {
-    text_coordinate_t new_top_left(0, 0);
-    text_pos_t count = 0;
-
     if (start < 0 || start + impl->edit_window.get_height() > impl->wrap_info->wrapped_size()) {
       return;
     }
 
-    for (new_top_left.line = 0; new_top_left.line < text->size() && count < start;
-         new_top_left.line++) {
-      count += impl->wrap_info->get_line_count(new_top_left.line);
-    }
-
-    if (count > start) {
-      new_top_left.line--;
-      count -= impl->wrap_info->get_line_count(new_top_left.line);
-      new_top_left.pos = start - count;
-    }
-
-    if (new_top_left == impl->top_left || new_top_left.line < 0) {
+    text_coordinate_t new_top_left = impl->wrap_info->find_row(start);
+    if (new_top_left == impl->top_left) {
       return;
     }
     impl->top_left = new_top_left;
@@ -199,6 +199,14 @@ class T3_WIDGET_API edit_window_t : public widget_t,
   void set_text(text_buffer_t *_text, const behavior_parameters_t *params = nullptr);
   /** Get the text currently displayed. */
   text_buffer_t *get_text() const;
+  /** Update the display after lines were appended to the text by other means than this
+      edit_window_t.
+      @param first_line The first line that was changed.
+
+      This is meant to be connected to the text_loader_t::lines_appended signal, such that the text
+      can be shown and scrolled while it is being loaded. Unlike #force_redraw, this does not move
+      the view to the cursor. */
+  void lines_appended(text_pos_t first_line);
   /** Apply the undo action. */
   void undo();
   /** Apply the redo action. */
@@ -67,6 +67,8 @@ class T3_WIDGET_LOCAL text_field_t::drop_down_list_t : public popup_t {
   text_field_t *field; /**< text_field_t this drop-down list is created for. */
 
   std::unique_ptr<filtered_string_list_base_t> completions; /**< List of possible selections. */
+  /** Copy of the text of #field used by the filter of #completions. */
+  std::string filter_text;
   list_pane_t *list_pane;
 
   void update_list_pane();
@@ -344,8 +346,8 @@ bool text_field_t::process_key(key_t key) {
                 end = impl->selection_start_pos;
               }
 
-              set_clipboard(
-                  t3widget::make_unique<std::string>(impl->line->get_data(), start, (end - start)));
+              const string_view data = impl->line->get_view().substr(start, end - start);
+              set_clipboard(t3widget::make_unique<std::string>(data.data(), data.size()));
             }
             return true;
 
@@ -359,7 +361,7 @@ bool text_field_t::process_key(key_t key) {
 
               // Don't allow pasting of values that do not match the filter
               if (impl->filter_keys != nullptr) {
-                const std::string &insert_data = insert_line->get_data();
+                const string_view insert_data = insert_line->get_view();
                 size_t insert_data_length = insert_data.size();
                 size_t bytes_read;
                 do {
@@ -611,7 +613,7 @@ void text_field_t::set_key_filter(key_t *keys, size_t nr_of_keys, bool accept) {
   impl->filter_keys_accept = accept;
 }
 
-const std::string &text_field_t::get_text() const { return impl->line->get_data(); }
+std::string text_field_t::get_text() const { return impl->line->get_data(); }
 
 void text_field_t::set_autocomplete(string_list_base_t *completions) {
   if (impl->drop_down_list == nullptr) {
@@ -715,7 +717,8 @@ void text_field_t::set_selection_end(bool update_primary) {
       start = impl->selection_end_pos;
       length = impl->selection_start_pos - start;
     }
-    set_primary(t3widget::make_unique<std::string>(impl->line->get_data(), start, length));
+    const string_view data = impl->line->get_view().substr(start, length);
+    set_primary(t3widget::make_unique<std::string>(data.data(), data.size()));
   }
 }
 
@@ -844,7 +847,8 @@ void text_field_t::drop_down_list_t::update_view() {
     if (field->impl->line->size() == 0) {
       completions->reset_filter();
     } else {
-      completions->set_filter(bind_front(string_compare_filter, &field->impl->line->get_data()));
+      filter_text = field->impl->line->get_data();
+      completions->set_filter(bind_front(string_compare_filter, &filter_text));
     }
     update_list_pane();
   }
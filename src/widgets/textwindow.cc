@@ -66,6 +66,7 @@ text_window_t::text_window_t(text_buffer_t *_text, bool with_scrollbar)
   }
 
   impl->wrap_info.reset(new wrap_info_t(impl->scrollbar != nullptr ? 11 : 12));
+  impl->wrap_info->connect_rows_changed([this] { force_redraw(); });
   impl->wrap_info->set_text_buffer(impl->text);
 }
 
@@ -233,11 +234,7 @@ void text_window_t::update_contents() {
 
   window.clrtobot();
 
-  text_pos_t count = 0;
-  for (text_pos_t i = 0; i < impl->top.line; i++) {
-    count += impl->wrap_info->get_line_count(i);
-  }
-  count += impl->top.pos;
+  text_pos_t count = impl->wrap_info->get_rows_before(impl->top.line) + impl->top.pos;
 
   if (impl->scrollbar != nullptr) {
     impl->scrollbar->set_parameters(
@@ -303,25 +300,12 @@ void text_window_t::scrollbar_clicked(scrollbar_t::step_t step) {
 }
 
 void text_window_t::scrollbar_dragged(text_pos_t start) {
-  text_coordinate_t new_top_left(0, 0);
-  text_pos_t count = 0;
-
   if (start < 0 || start + window.get_height() > impl->wrap_info->wrapped_size()) {
     return;
   }
 
-  for (new_top_left.line = 0; new_top_left.line < impl->text->size() && count < start;
-       new_top_left.line++) {
-    count += impl->wrap_info->get_line_count(new_top_left.line);
-  }
-
-  if (count > start) {
-    new_top_left.line--;
-    count -= impl->wrap_info->get_line_count(new_top_left.line);
-    new_top_left.pos = start - count;
-  }
-
-  if (new_top_left == impl->top || new_top_left.line < 0) {
+  text_coordinate_t new_top_left = impl->wrap_info->find_row(start);
+  if (new_top_left == impl->top) {
     return;
   }
   impl->top = new_top_left;
@@ -14,101 +14,406 @@
 
 #include "t3widget/wrapinfo.h"
 
+#include <algorithm>
+#include <chrono>
 #include <cstddef>
+#include <functional>
 #include <limits>
 #include <memory>
 #include <type_traits>
 #include <utility>
+#include <vector>
 
 #include "t3widget/internal.h"
+#include "t3widget/linetree.h"
 #include "t3widget/log.h"
+#include "t3widget/main.h"
 #include "t3widget/textbuffer.h"
 #include "t3widget/textbuffer_impl.h"
 #include "t3widget/util.h"
 
 namespace t3widget {
 
+void wrap_data_t::insert_lines(text_pos_t first, text_pos_t count) {
+  lines.insert(lines.begin() + first, count, line_t());
+}
+
+void wrap_data_t::erase_lines(text_pos_t first, text_pos_t last) {
+  for (text_pos_t i = first; i < last; ++i) {
+    unused += lines[i].count;
+  }
+  lines.erase(lines.begin() + first, lines.begin() + last);
+  compact();
+}
+
+void wrap_data_t::set_breaks(text_pos_t line, text_pos_t keep, const text_pos_t *new_breaks,
+                             size_t count) {
+  if (!wide) {
+    for (size_t i = 0; i < count; ++i) {
+      if (new_breaks[i] > std::numeric_limits<uint32_t>::max()) {
+        wide_breaks.assign(breaks.begin(), breaks.end());
+        breaks.clear();
+        breaks.shrink_to_fit();
+        wide = true;
+        break;
+      }
+    }
+  }
+
+  line_t &entry = lines[line];
+  const size_t new_count = keep - 1 + count;
+  if (new_count > entry.count) {
+    if (entry.count > 0 && entry.start + entry.count == breaks_size()) {
+      /* The line is stored at the end of the array, so it can grow in place. */
+      resize_breaks(entry.start + new_count);
+    } else {
+      const size_t new_start = breaks_size();
+      resize_breaks(new_start + new_count);
+      for (text_pos_t i = 1; i < keep; ++i) {
+        set(new_start + i - 1, get(line, i));
+      }
+      unused += entry.count;
+      entry.start = new_start;
+    }
+  } else {
+    unused += entry.count - new_count;
+  }
+  entry.count = new_count;
+  for (size_t i = 0; i < count; ++i) {
+    set(entry.start + keep - 1 + i, new_breaks[i]);
+  }
+  if (new_count == 0) {
+    entry.start = 0;
+  }
+  compact();
+}
+
+void wrap_data_t::resize_breaks(size_t new_size) {
+  if (wide) {
+    wide_breaks.resize(new_size);
+  } else {
+    breaks.resize(new_size);
+  }
+}
+
+void wrap_data_t::set(size_t pos, text_pos_t value) {
+  if (wide) {
+    wide_breaks[pos] = value;
+  } else {
+    breaks[pos] = value;
+  }
+}
+
+/* Rebuilds the array of break positions without the unused elements, if enough are unused. */
+void wrap_data_t::compact() {
+  if (unused < 4096 || unused < breaks_size() / 2) {
+    return;
+  }
+  if (wide) {
+    compact(&wide_breaks);
+  } else {
+    compact(&breaks);
+  }
+  unused = 0;
+}
+
+template <typename T>
+void wrap_data_t::compact(std::vector<T> *array) {
+  std::vector<T> result;
+  result.reserve(array->size() - unused);
+  for (line_t &entry : lines) {
+    if (entry.count == 0) {
+      continue;
+    }
+    const size_t start = result.size();
+    result.insert(result.end(), array->begin() + entry.start,
+                  array->begin() + entry.start + entry.count);
+    entry.start = start;
+  }
+  array->swap(result);
+}
+
 wrap_info_t::wrap_info_t(int width, int _tabsize)
-    : text(nullptr), tabsize(_tabsize), wrap_width(width), size(0) {}
+    : text(nullptr),
+      tabsize(_tabsize),
+      wrap_width(width),
+      size(0),
+      last_change(),
+      pending_count(0),
+      pending_scan(0),
+      row_tree_valid(0) {}
 
 wrap_info_t::~wrap_info_t() {
   rewrap_connection.disconnect();
-  for (wrap_points_t *iter : wrap_data) {
-    delete iter;
-  }
+  change_connection.disconnect();
+  pending_connection.disconnect();
 }
 
 text_pos_t wrap_info_t::unwrapped_size() const { return wrap_data.size(); }
 text_pos_t wrap_info_t::wrapped_size() const { return size; }
 
+static text_pos_t lowest_bit(text_pos_t x) { return x & -x; }
+
+void wrap_info_t::invalidate_rows(text_pos_t first) {
+  row_tree_valid = std::min(row_tree_valid, first);
+}
+
+void wrap_info_t::update_rows(text_pos_t line, text_pos_t delta) const {
+  /* Nodes beyond row_tree_valid are recomputed from wrap_data by build_rows. */
+  for (text_pos_t i = line + 1; i <= row_tree_valid; i += lowest_bit(i)) {
+    row_tree[i] += delta;
+  }
+}
+
+void wrap_info_t::build_rows() const {
+  const text_pos_t lines = wrap_data.size();
+  if (row_tree_valid == lines) {
+    return;
+  }
+  row_tree.resize(lines + 1);
+  const text_pos_t first = row_tree_valid;
+  /* Node i holds the number of rows of the lines in [i - lowest_bit(i), i). The nodes up to first
+     are complete, and only contribute to the nodes after first through the nodes that make up the
+     prefix sum up to first. The remaining nodes are built in linear time by adding each complete
+     node to its parent. */
+  for (text_pos_t i = first + 1; i <= lines; ++i) {
+    row_tree[i] = wrap_data.rows(i - 1);
+  }
+  for (text_pos_t i = first; i > 0; i -= lowest_bit(i)) {
+    const text_pos_t parent = i + lowest_bit(i);
+    if (parent <= lines) {
+      row_tree[parent] += row_tree[i];
+    }
+  }
+  for (text_pos_t i = first + 1; i <= lines; ++i) {
+    const text_pos_t parent = i + lowest_bit(i);
+    if (parent <= lines) {
+      row_tree[parent] += row_tree[i];
+    }
+  }
+  row_tree_valid = lines;
+}
+
+text_pos_t wrap_info_t::get_rows_before(text_pos_t line) const {
+  build_rows();
+  text_pos_t result = 0;
+  for (text_pos_t i = line; i > 0; i -= lowest_bit(i)) {
+    result += row_tree[i];
+  }
+  return result;
+}
+
+text_coordinate_t wrap_info_t::find_row(text_pos_t row) const {
+  build_rows();
+  const text_pos_t lines = wrap_data.size();
+  text_pos_t step = 1;
+  while (step * 2 <= lines) {
+    step *= 2;
+  }
+  /* Find the number of lines whose rows all lie before row. As every line has at least one row,
+     the next line contains row. */
+  text_pos_t line = 0;
+  for (; step > 0; step /= 2) {
+    if (line + step <= lines && row_tree[line + step] <= row) {
+      line += step;
+      row -= row_tree[line];
+    }
+  }
+  return text_coordinate_t(line, row);
+}
+
 void wrap_info_t::delete_lines(text_pos_t first, text_pos_t last) {
-  for (wrap_data_t::iterator iter = wrap_data.begin() + first; iter != wrap_data.begin() + last;
-       iter++) {
-    size -= (*iter)->size();
-    delete *iter;
+  for (text_pos_t i = first; i < last; ++i) {
+    size -= wrap_data.rows(i);
   }
-  wrap_data.erase(wrap_data.begin() + first, wrap_data.begin() + last);
+  wrap_data.erase_lines(first, last);
+  pending_count -= std::count(pending.begin() + first, pending.begin() + last, true);
+  pending.erase(pending.begin() + first, pending.begin() + last);
+  invalidate_rows(first);
 }
 
 void wrap_info_t::insert_lines(text_pos_t first, text_pos_t last) {
-  text_pos_t i;
-  for (i = first; i < last; i++) {
-    wrap_data.insert(wrap_data.begin() + i, new wrap_points_t());
-    // Ensure that the list of break positions contains at least the start position.
-    wrap_data[i]->push_back(0);
-    size++;
-    rewrap_line(i, 0, true);
-  }
+  wrap_data.insert_lines(first, last - first);
+  pending.insert(pending.begin() + first, last - first, false);
+  size += last - first;
+  mark_pending(first, last);
 }
 
 void wrap_info_t::rewrap_line(text_pos_t line, text_pos_t pos, bool local) {
-  text_line_t::break_pos_t break_pos;
-  size_t i;
+  text_pos_t i;
+
+  /* Pending lines are wrapped as a whole when they are first accessed. */
+  if (pending[line]) {
+    return;
+  }
 
   /* The list of break positions always contains the start position (0). */
 
-  for (i = wrap_data[line]->size() - 1; i > 0 && (*wrap_data[line])[i] > pos; i--) {
+  for (i = wrap_data.rows(line) - 1; i > 0 && wrap_data.get(line, i) > pos; i--) {
+  }
+  /* The end of the preceding rows is also affected if finding it involved the text at pos. */
+  const text_line_t &text_line = *text->impl->lines.at(line);
+  while (i > 0 && text_line.calculate_screen_width(wrap_data.get(line, i - 1), pos, tabsize) <
+                      wrap_width) {
+    i--;
   }
 
-  if (local) {
-    break_pos = text->impl->lines[line]->find_next_break_pos((*wrap_data[line])[i], wrap_width - 1,
-                                                             tabsize);
-    if (i < wrap_data[line]->size() - 1 && break_pos.pos == (*wrap_data[line])[i + 1]) {
-      return;
-    }
+  if (local && last_change.sequence == text->impl->change_sequence &&
+      last_change.start.line == line && last_change.old_end.line == line &&
+      last_change.new_end.line == line) {
+    wrap_line(line, i, last_change.new_end.pos, last_change.new_end.pos - last_change.old_end.pos);
+    return;
   }
+  wrap_line(line, i);
+}
+
+/* Recompute the break positions of @p line after break position @p i. If the text from
+   @p unchanged_from onwards was at that position minus @p delta before the change, the remaining
+   break positions only need to be shifted by @p delta once a new break position is found there
+   which matches a shifted old break position. From that point the rows are the same as before. */
+void wrap_info_t::wrap_line(text_pos_t line, text_pos_t i, text_pos_t unchanged_from,
+                            text_pos_t delta) const {
+  const text_line_t &text_line = *text->impl->lines.at(line);
+  text_line_t::break_pos_t break_pos;
 
   /* Keep it simple: subtract the full size here, and add the full size again
      when we are done rewrapping. */
-  size -= wrap_data[line]->size();
-  wrap_data[line]->erase(wrap_data[line]->begin() + i + 1, wrap_data[line]->end());
+  const text_pos_t old_count = wrap_data.rows(line);
+  size -= old_count;
+  break_buffer.clear();
 
+  text_pos_t pos = wrap_data.get(line, i);
+  text_pos_t old_idx = i + 1;
   while (true) {
-    break_pos = text->impl->lines[line]->find_next_break_pos(wrap_data[line]->back(),
-                                                             wrap_width - 1, tabsize);
-    if (break_pos.pos > 0) {
-      wrap_data[line]->push_back(break_pos.pos);
-    } else {
+    break_pos = text_line.find_next_break_pos(pos, wrap_width - 1, tabsize);
+    if (break_pos.pos <= 0) {
+      old_idx = old_count;
       break;
     }
+    pos = break_pos.pos;
+    break_buffer.push_back(pos);
+    if (pos >= unchanged_from) {
+      while (old_idx < old_count && wrap_data.get(line, old_idx) + delta < pos) {
+        ++old_idx;
+      }
+      if (old_idx < old_count && wrap_data.get(line, old_idx) + delta == pos) {
+        ++old_idx;
+        break;
+      }
+    }
+  }
+  for (; old_idx < old_count; ++old_idx) {
+    break_buffer.push_back(wrap_data.get(line, old_idx) + delta);
   }
-  size += wrap_data[line]->size();
+
+  wrap_data.set_breaks(line, i + 1, break_buffer.data(), break_buffer.size());
+  size += wrap_data.rows(line);
+  update_rows(line, wrap_data.rows(line) - old_count);
 }
 
-void wrap_info_t::rewrap_all() {
-  for (size_t i = 0; i < wrap_data.size(); i++) {
-    rewrap_line(i, 0, false);
+/* Check whether @p line fits on a single row. This is cheaper than searching for a break position,
+   as the width is available from the line's metadata for lines of printable ASCII characters, and
+   cached by text_line_t for lines without tabs. Lines with a width of exactly the wrap width are
+   left to find_next_break_pos. */
+bool wrap_info_t::fits_single_row(text_pos_t line) const {
+  const text_line_t &text_line = *text->impl->lines.at(line);
+  return text_line.calculate_screen_width(0, std::numeric_limits<text_pos_t>::max(), tabsize) <
+         wrap_width - 1;
+}
+
+void wrap_info_t::ensure_wrapped(text_pos_t line) const {
+  if (!pending[line]) {
+    return;
+  }
+  pending[line] = false;
+  --pending_count;
+  /* Pending lines have a single row already. */
+  if (!fits_single_row(line)) {
+    wrap_line(line, 0);
+  }
+}
+
+void wrap_info_t::ensure_wrapped(text_pos_t first, text_pos_t last) const {
+  if (pending_count == 0) {
+    return;
+  }
+  for (text_pos_t i = first; i < last; ++i) {
+    ensure_wrapped(i);
   }
 }
 
+/* Number of lines up to which marking lines as pending wraps them immediately. */
+static const text_pos_t eager_wrap_lines = 1024;
+
+void wrap_info_t::mark_pending(text_pos_t first, text_pos_t last, bool keep_single_rows) {
+  for (text_pos_t i = first; i < last; ++i) {
+    if (keep_single_rows && !pending[i] && wrap_data.rows(i) == 1) {
+      continue;
+    }
+    size -= wrap_data.rows(i) - 1;
+    wrap_data.set_breaks(i, 1, nullptr, 0);
+    if (!pending[i]) {
+      pending[i] = true;
+      ++pending_count;
+    }
+  }
+  invalidate_rows(first);
+
+  if (last - first <= eager_wrap_lines || pending_count == 0) {
+    ensure_wrapped(first, last);
+    return;
+  }
+
+  pending_scan = 0;
+  pending_connection.disconnect();
+  pending_connection = connect_update_notification([this] { wrap_pending(); });
+  signal_update();
+}
+
+/* Wraps pending lines until the time slice runs out, such that the main loop stays responsive. */
+void wrap_info_t::wrap_pending() {
+  const std::chrono::steady_clock::time_point deadline =
+      std::chrono::steady_clock::now() + std::chrono::milliseconds(10);
+  const text_pos_t lines = wrap_data.size();
+  text_pos_t wrapped = 0;
+
+  for (text_pos_t scanned = 0; pending_count > 0 && scanned < lines; ++scanned, ++pending_scan) {
+    if (pending_scan >= lines) {
+      pending_scan = 0;
+    }
+    if (!pending[pending_scan]) {
+      continue;
+    }
+    ensure_wrapped(pending_scan);
+    if (++wrapped % 64 == 0 && std::chrono::steady_clock::now() >= deadline) {
+      break;
+    }
+  }
+
+  if (pending_count == 0) {
+    pending_connection.disconnect();
+  } else {
+    signal_update();
+  }
+  if (wrapped > 0) {
+    rows_changed();
+  }
+}
+
+void wrap_info_t::rewrap_all(bool keep_single_rows) {
+  mark_pending(0, wrap_data.size(), keep_single_rows);
+}
+
 void wrap_info_t::set_wrap_width(int width) {
   lprintf("Setting wrap width: %d\n", width);
   if (width == wrap_width) {
     return;
   }
+  /* Lines that fit on a single row still do when the wrap width increases. */
+  const bool keep_single_rows = width > wrap_width;
   wrap_width = width;
   if (text != nullptr) {
-    rewrap_all();
+    rewrap_all(keep_single_rows);
   }
 }
 
@@ -124,6 +429,8 @@ void wrap_info_t::set_tabsize(int _tabsize) {
 
 void wrap_info_t::set_text_buffer(text_buffer_t *_text) {
   rewrap_connection.disconnect();
+  change_connection.disconnect();
+  pending_connection.disconnect();
 
   text = _text;
   if (_text == nullptr) {
@@ -131,17 +438,17 @@ void wrap_info_t::set_text_buffer(text_buffer_t *_text) {
   }
 
   rewrap_connection = text->connect_rewrap_required(bind_front(&wrap_info_t::rewrap, this));
+  change_connection =
+      text->connect_text_changed([this](const text_change_t &change) { last_change = change; });
 
-  if (wrap_data.size() > text->impl->lines.size()) {
-    delete_lines(text->impl->lines.size(), wrap_data.size());
+  if (wrap_data.size() > text->size()) {
+    delete_lines(text->size(), wrap_data.size());
   }
 
-  for (size_t i = 0; i < wrap_data.size(); i++) {
-    rewrap_line(i, 0, false);
-  }
+  rewrap_all();
 
-  if (wrap_data.size() < text->impl->lines.size()) {
-    insert_lines(wrap_data.size(), text->impl->lines.size());
+  if (wrap_data.size() < text->size()) {
+    insert_lines(wrap_data.size(), text->size());
   }
 }
 
@@ -169,58 +476,53 @@ void wrap_info_t::rewrap(rewrap_type_t type, text_pos_t a, text_pos_t b) {
 
 bool wrap_info_t::add_lines(text_coordinate_t &coord, text_pos_t count) const {
   ASSERT(count > 0);
-  while (static_cast<size_t>(coord.line) < wrap_data.size() &&
-         wrap_data[coord.line]->size() <= static_cast<size_t>(coord.pos + count)) {
-    count -= wrap_data[coord.line]->size() - coord.pos;
-    coord.line++;
-    coord.pos = 0;
-  }
-  if (static_cast<size_t>(coord.line) == wrap_data.size()) {
-    coord.line = wrap_data.size() - 1;
-    coord.pos = wrap_data[coord.line]->size() - 1;
-    return true;
-  } else {
+  /* Each line has at least one sub-line, so the destination lies within count lines. */
+  ensure_wrapped(coord.line,
+                 std::min(coord.line + count + 1, static_cast<text_pos_t>(wrap_data.size())));
+  if (coord.pos + count < wrap_data.rows(coord.line)) {
     coord.pos += count;
     return false;
   }
+  const text_pos_t row = get_rows_before(coord.line) + coord.pos + count;
+  if (row >= size) {
+    coord = get_end();
+    return true;
+  }
+  coord = find_row(row);
+  return false;
 }
 
 bool wrap_info_t::sub_lines(text_coordinate_t &coord, text_pos_t count) const {
   ASSERT(count > 0);
+  ensure_wrapped(std::max<text_pos_t>(coord.line - count, 0), coord.line + 1);
   if (coord.pos > count) {
     coord.pos -= count;
     return false;
   }
-  count -= coord.pos;
-  coord.pos = 0;
-  while (coord.line > 0 && static_cast<size_t>(count) >= wrap_data[coord.line - 1]->size()) {
-    coord.line--;
-    count -= wrap_data[coord.line]->size();
-  }
-  if (count == 0) {
-    return false;
-  }
-  if (coord.line == 0) {
+  const text_pos_t row = get_rows_before(coord.line) + coord.pos - count;
+  if (row < 0) {
+    coord = text_coordinate_t(0, 0);
     return true;
   }
-  coord.line--;
-  coord.pos = wrap_data[coord.line]->size() - count;
+  coord = find_row(row);
   return false;
 }
 
 text_pos_t wrap_info_t::get_line_count(text_pos_t line) const {
-  return static_cast<text_pos_t>(wrap_data[line]->size());
+  ensure_wrapped(line);
+  return wrap_data.rows(line);
 }
 
 text_coordinate_t wrap_info_t::get_end() const {
-  text_coordinate_t result(static_cast<text_pos_t>(wrap_data.size()) - 1,
-                           static_cast<text_pos_t>(wrap_data[wrap_data.size() - 1]->size()) - 1);
+  ensure_wrapped(wrap_data.size() - 1);
+  text_coordinate_t result(wrap_data.size() - 1, wrap_data.rows(wrap_data.size() - 1) - 1);
   return result;
 }
 
 text_pos_t wrap_info_t::find_line(text_coordinate_t coord) const {
-  size_t i;
-  for (i = 1; i < wrap_data[coord.line]->size() && coord.pos >= (*wrap_data[coord.line])[i]; i++) {
+  text_pos_t i;
+  ensure_wrapped(coord.line);
+  for (i = 1; i < wrap_data.rows(coord.line) && coord.pos >= wrap_data.get(coord.line, i); i++) {
   }
   return i - 1;
 }
@@ -231,26 +533,28 @@ text_pos_t wrap_info_t::calculate_screen_pos() const {
 
 text_pos_t wrap_info_t::calculate_screen_pos(const text_coordinate_t &where) const {
   text_pos_t sub_line = find_line(text->impl->cursor);
-  return text->impl->lines[where.line]->calculate_screen_width((*wrap_data[where.line])[sub_line],
-                                                               where.pos, tabsize);
+  ensure_wrapped(where.line);
+  return text->impl->lines.at(where.line)->calculate_screen_width(
+      wrap_data.get(where.line, sub_line), where.pos, tabsize);
 }
 
 text_pos_t wrap_info_t::calculate_line_pos(text_pos_t line, text_pos_t pos,
                                            text_pos_t sub_line) const {
-  return text->impl->lines[line]->calculate_line_pos(
-      (*wrap_data[line])[sub_line],
-      static_cast<size_t>(sub_line) + 1 < wrap_data[line]->size()
-          ? (*wrap_data[line])[sub_line + 1] - 1
+  ensure_wrapped(line);
+  return text->impl->lines.at(line)->calculate_line_pos(
+      wrap_data.get(line, sub_line),
+      sub_line + 1 < wrap_data.rows(line) ? wrap_data.get(line, sub_line + 1) - 1
           : std::numeric_limits<text_pos_t>::max(),
       pos, tabsize);
 }
 
 void wrap_info_t::paint_line(t3window::window_t *win, text_coordinate_t line,
                              text_line_t::paint_info_t &info) const {
-  info.start = (*wrap_data[line.line])[line.pos];
+  ensure_wrapped(line.line);
+  info.start = wrap_data.get(line.line, line.pos);
   info.flags &= ~text_line_t::BREAK;
-  if (static_cast<size_t>(line.pos) + 1 < wrap_data[line.line]->size()) {
-    info.max = (*wrap_data[line.line])[(line.pos + 1)];
+  if (line.pos + 1 < wrap_data.rows(line.line)) {
+    info.max = wrap_data.get(line.line, line.pos + 1);
     info.flags |= text_line_t::BREAK;
   } else {
     info.max = std::numeric_limits<text_pos_t>::max();
@@ -264,4 +568,8 @@ void wrap_info_t::paint_line(t3window::window_t *win, text_coordinate_t line,
   text->paint_line(win, line.line, info);
 }
 
+connection_t wrap_info_t::connect_rows_changed(std::function<void()> cb) {
+  return rows_changed.connect(cb);
+}
+
 }  // namespace t3widget
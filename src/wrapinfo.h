@@ -23,13 +23,66 @@
 #include <t3widget/textline.h>
 #include <t3widget/util.h>
 #include <t3widget/widget_api.h>
+#include <cstdint>
+#include <limits>
 #include <t3window/window.h>
 #include <vector>
 
 namespace t3widget {
 
-typedef std::vector<text_pos_t> wrap_points_t;
-typedef std::vector<wrap_points_t *> wrap_data_t;
+/** Storage for the break positions of the lines of a text.
+
+    Each line has an implicit break position at 0. Lines that fit on a single row, which is the
+    common case, need no storage beyond a small fixed-size entry. The other break positions of all
+    lines are stored in a single flat array, which uses 32-bit values until a break position no
+    longer fits. Space left behind by lines that are rewrapped is reclaimed by compacting the array
+    once it makes up half of it.
+*/
+class T3_WIDGET_LOCAL wrap_data_t {
+ public:
+  /** Get the number of lines. */
+  text_pos_t size() const { return lines.size(); }
+  /** Get the number of rows of @p line, i.e. its number of break positions including 0. */
+  text_pos_t rows(text_pos_t line) const { return static_cast<text_pos_t>(lines[line].count) + 1; }
+  /** Get break position @p idx of @p line. */
+  text_pos_t get(text_pos_t line, text_pos_t idx) const {
+    if (idx == 0) {
+      return 0;
+    }
+    const size_t pos = lines[line].start + idx - 1;
+    return wide ? wide_breaks[pos] : breaks[pos];
+  }
+
+  /** Insert @p count lines of a single row before @p first. */
+  void insert_lines(text_pos_t first, text_pos_t count);
+  /** Remove the lines in [@p first, @p last). */
+  void erase_lines(text_pos_t first, text_pos_t last);
+  /** Replace the break positions of @p line from index @p keep onwards by @p count positions. */
+  void set_breaks(text_pos_t line, text_pos_t keep, const text_pos_t *new_breaks, size_t count);
+
+ private:
+  /* The array holds the break positions of all lines, so its indices need not fit in 32 bits even
+     if the break positions do. */
+  struct line_t {
+    size_t start = 0;
+    size_t count = 0;
+  };
+
+  std::vector<line_t> lines;
+  std::vector<uint32_t> breaks;
+  /* Used instead of breaks once a break position does not fit in 32 bits. */
+  std::vector<text_pos_t> wide_breaks;
+  bool wide = false;
+  /* Number of elements of the array no longer used by any line. */
+  size_t unused = 0;
+
+  size_t breaks_size() const { return wide ? wide_breaks.size() : breaks.size(); }
+  void resize_breaks(size_t new_size);
+  void set(size_t pos, text_pos_t value);
+  void compact();
+  template <typename T>
+  void compact(std::vector<T> *array);
+};
 
 /** Class holding information about wrapping a text_buffer_t.
 
@@ -41,17 +94,48 @@ typedef std::vector<wrap_points_t *> wrap_data_t;
 */
 class T3_WIDGET_LOCAL wrap_info_t {
  private:
-  wrap_data_t wrap_data;
+  mutable wrap_data_t wrap_data;
   text_buffer_t *text;
   int tabsize;
   int wrap_width;
-  text_pos_t size;
+  mutable text_pos_t size;
+  /* Break positions computed by wrap_line, kept to avoid allocating a new vector on each call. */
+  mutable std::vector<text_pos_t> break_buffer;
   connection_t rewrap_connection;
+  /* The last change to the text. The REWRAP_LINE_LOCAL requests of text_buffer_t are sent after
+     the change is reported, which allows rewrap_line to stop once the new break positions match
+     the old break positions after the changed range. */
+  text_change_t last_change;
+  connection_t change_connection;
+  /* Lines which have not been wrapped yet. These are counted as a single sub-line until they are
+     wrapped, either when they are accessed or when the update_notification signal is received. This
+     allows rewrapping large texts without blocking until all lines are done. */
+  mutable std::vector<bool> pending;
+  mutable text_pos_t pending_count;
+  text_pos_t pending_scan;
+  connection_t pending_connection;
+  signal_t<> rows_changed;
+  /* Fenwick tree over the number of sub-lines of each line, which makes conversions between lines
+     and wrapped rows O(log n). Only the nodes up to row_tree_valid are up to date, such that
+     inserting or deleting lines only requires rebuilding the nodes after the first changed line.
+     The tree is rebuilt by build_rows when needed. */
+  mutable std::vector<text_pos_t> row_tree;
+  mutable text_pos_t row_tree_valid;
 
+  void invalidate_rows(text_pos_t first);
+  void update_rows(text_pos_t line, text_pos_t delta) const;
+  void build_rows() const;
+  void wrap_line(text_pos_t line, text_pos_t i,
+                 text_pos_t unchanged_from = std::numeric_limits<text_pos_t>::max(),
+                 text_pos_t delta = 0) const;
+  bool fits_single_row(text_pos_t line) const;
+  void ensure_wrapped(text_pos_t line) const;
+  void ensure_wrapped(text_pos_t first, text_pos_t last) const;
+  void mark_pending(text_pos_t first, text_pos_t last, bool keep_single_rows = false);
   void delete_lines(text_pos_t first, text_pos_t last);
   void insert_lines(text_pos_t first, text_pos_t last);
   void rewrap_line(text_pos_t line, text_pos_t pos, bool force);
-  void rewrap_all();
+  void rewrap_all(bool keep_single_rows = false);
   void rewrap(rewrap_type_t type, text_pos_t a, text_pos_t b);
 
  public:
@@ -68,12 +152,22 @@ class T3_WIDGET_LOCAL wrap_info_t {
   bool add_lines(text_coordinate_t &coord, text_pos_t count) const;
   bool sub_lines(text_coordinate_t &coord, text_pos_t count) const;
   text_coordinate_t get_end() const;
+  /* Get the number of wrapped rows before line @p line. */
+  text_pos_t get_rows_before(text_pos_t line) const;
+  /* Get the line and sub-line of wrapped row @p row. */
+  text_coordinate_t find_row(text_pos_t row) const;
   text_pos_t find_line(text_coordinate_t coord) const;
   text_pos_t calculate_screen_pos() const;
   text_pos_t calculate_screen_pos(const text_coordinate_t &where) const;
   text_pos_t calculate_line_pos(text_pos_t line, text_pos_t pos, text_pos_t subline) const;
   void paint_line(t3window::window_t *win, text_coordinate_t line,
                   text_line_t::paint_info_t &info) const;
+  /** Wrap pending lines for one time slice, as is done in response to the @c update_notification
+      signal. Only intended for testing without running the #main_loop function. */
+  void wrap_pending();
+
+  /* Emitted when lines have been wrapped in the background, changing the number of wrapped rows. */
+  T3_WIDGET_DECLARE_SIGNAL(rows_changed);
 };
 
 }  // namespace t3widget
@@ -0,0 +1,185 @@
+/* Copyright (C) 2018 G.P. Halkes
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License version 3, as
+   published by the Free Software Foundation.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Test line_tree_t against a std::vector holding the same lines. The number of lines is chosen
+// such that the tree gets three levels, and is then reduced again, such that nodes are split and
+// merged. The byte counts are checked against the sizes of the lines.
+
+#include <algorithm>
+#include <cstdlib>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "t3widget/linetree.h"
+#include "unittest.h"
+
+using namespace t3widget;
+
+static line_tree_t::line_ptr_t make_line(const std::string &text) {
+  return line_tree_t::line_ptr_t(new text_line_t(text));
+}
+
+static std::string line_text(const line_tree_t &tree, size_t idx) {
+  const string_view view = tree[idx]->get_view();
+  return std::string(view.data(), view.size());
+}
+
+static bool equal(const line_tree_t &tree, const std::vector<std::string> &model) {
+  if (tree.size() != model.size()) {
+    return false;
+  }
+  for (size_t i = 0; i < model.size(); ++i) {
+    if (line_text(tree, i) != model[i]) {
+      return false;
+    }
+  }
+  return true;
+}
+
+static void test_edits() {
+  line_tree_t tree;
+  std::vector<std::string> model;
+  int counter = 0;
+
+  CHECK(tree.empty());
+  for (int i = 0; i < 100; ++i) {
+    model.push_back(std::to_string(counter));
+    tree.push_back(make_line(std::to_string(counter++)));
+  }
+  CHECK(equal(tree, model));
+
+  // Grow the tree, mostly with bulk inserts, which split leaves and inner nodes.
+  while (model.size() < 40000) {
+    const size_t idx = std::rand() % (model.size() + 1);
+    if (std::rand() % 4 == 0) {
+      model.insert(model.begin() + idx, std::to_string(counter));
+      tree.insert(idx, make_line(std::to_string(counter++)));
+    } else {
+      std::vector<std::string> texts;
+      std::vector<line_tree_t::line_ptr_t> lines;
+      const size_t count = std::rand() % 2000;
+      for (size_t i = 0; i < count; ++i) {
+        texts.push_back(std::to_string(counter++));
+        lines.push_back(make_line(texts.back()));
+      }
+      model.insert(model.begin() + idx, texts.begin(), texts.end());
+      tree.insert(idx, std::move(lines));
+    }
+  }
+  CHECK(equal(tree, model));
+
+  // Insert part of a list of lines.
+  std::vector<line_tree_t::line_ptr_t> lines;
+  for (int i = 0; i < 10; ++i) {
+    lines.push_back(make_line("part " + std::to_string(i)));
+  }
+  tree.insert(5, lines.begin() + 2, lines.begin() + 7);
+  for (int i = 2; i < 7; ++i) {
+    model.insert(model.begin() + 5 + (i - 2), "part " + std::to_string(i));
+    CHECK(lines[i] == nullptr);
+  }
+  CHECK(lines[1] != nullptr && lines[7] != nullptr);
+  CHECK(equal(tree, model));
+
+  // Shrink the tree again, which merges or rebalances underfull nodes.
+  while (model.size() > 10) {
+    const size_t first = std::rand() % model.size();
+    const size_t last = std::min(model.size(), first + 1 + std::rand() % 3000);
+    model.erase(model.begin() + first, model.begin() + last);
+    tree.erase(first, last);
+  }
+  CHECK(equal(tree, model));
+
+  tree.erase(0, tree.size());
+  CHECK(tree.empty());
+  tree.push_back(make_line("again"));
+  CHECK(tree.size() == 1 && line_text(tree, 0) == "again");
+}
+
+static void test_copy() {
+  line_tree_t tree;
+  std::vector<std::string> model;
+  for (int i = 0; i < 20000; ++i) {
+    model.push_back(std::to_string(i));
+    tree.push_back(make_line(std::to_string(i)));
+  }
+
+  const line_tree_t copy(tree);
+  tree.erase(100, 5000);
+  tree.insert(0, make_line("first"));
+  tree[1000]->set_text("changed");
+
+  // The copy is not affected by changes to the original.
+  CHECK(equal(copy, model));
+  CHECK(tree.size() == model.size() - 4900 + 1);
+  CHECK(line_text(tree, 0) == "first");
+  CHECK(line_text(tree, 1000) == "changed");
+}
+
+static bool check_bytes(const line_tree_t &tree) {
+  size_t bytes = 0;
+  for (size_t i = 0; i < tree.size(); ++i) {
+    if (tree.bytes_before(i) != bytes) {
+      return false;
+    }
+    // The first byte of the line, the line separator and a byte in between.
+    const size_t line_bytes = tree[i]->size() + 1;
+    for (size_t offset : {size_t(0), line_bytes / 2, line_bytes - 1}) {
+      size_t found_offset = bytes + offset;
+      if (tree.find_byte_offset(&found_offset) != i || found_offset != offset) {
+        return false;
+      }
+    }
+    bytes += line_bytes;
+  }
+  size_t beyond = bytes;
+  return tree.total_bytes() == bytes && tree.bytes_before(tree.size()) == bytes &&
+         tree.find_byte_offset(&beyond) == tree.size();
+}
+
+static void test_byte_offsets() {
+  line_tree_t tree;
+  CHECK(tree.total_bytes() == 0);
+  for (int i = 0; i < 30000; ++i) {
+    tree.push_back(make_line(std::string(std::rand() % 50, 'x')));
+  }
+  CHECK(check_bytes(tree));
+
+  // Modifying lines through the non-const operator[] updates the counts.
+  for (int i = 0; i < 100; ++i) {
+    tree[std::rand() % tree.size()]->set_text(std::string(std::rand() % 200, 'y'));
+  }
+  CHECK(check_bytes(tree));
+
+  tree.erase(1000, 20000);
+  tree.insert(500, make_line("inserted"));
+  CHECK(check_bytes(tree));
+
+  // A copy keeps its own counts.
+  const line_tree_t copy(tree);
+  const size_t copy_bytes = copy.total_bytes();
+  tree[0]->set_text(std::string(1000, 'z'));
+  CHECK(copy.total_bytes() == copy_bytes);
+  CHECK(tree.total_bytes() == copy_bytes + 1000 - copy[0]->size());
+  CHECK(check_bytes(tree));
+  CHECK(check_bytes(copy));
+}
+
+int main(int, char **) {
+  test_edits();
+  test_copy();
+  test_byte_offsets();
+  return unittest_result();
+}
@@ -0,0 +1,519 @@
+/* Copyright (C) 2018 G.P. Halkes
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License version 3, as
+   published by the Free Software Foundation.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Test the bookkeeping of text_buffer_t that is not visible on screen.
+
+#include <atomic>
+#include <chrono>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iterator>
+#include <memory>
+#include <string>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+#include "t3widget/textbuffer.h"
+#include "unittest.h"
+
+using namespace t3widget;
+
+static bool same(const text_coordinate_t &a, text_pos_t line, text_pos_t pos) {
+  return a.line == line && a.pos == pos;
+}
+
+static void test_byte_offsets() {
+  text_buffer_t text;
+  text.append_text("ab\ncde\n\nf");
+
+  CHECK(text.get_byte_size() == 9);
+  CHECK(text.get_byte_offset(text_coordinate_t(0, 0)) == 0);
+  CHECK(text.get_byte_offset(text_coordinate_t(1, 2)) == 5);
+  CHECK(text.get_byte_offset(text_coordinate_t(2, 0)) == 7);
+  CHECK(text.get_byte_offset(text_coordinate_t(3, 1)) == 9);
+
+  CHECK(same(text.get_coordinate_at_byte_offset(0), 0, 0));
+  CHECK(same(text.get_coordinate_at_byte_offset(5), 1, 2));
+  // Line separators map to the end of the preceding line.
+  CHECK(same(text.get_coordinate_at_byte_offset(2), 0, 2));
+  CHECK(same(text.get_coordinate_at_byte_offset(7), 2, 0));
+  // Offsets beyond the end of the text map to the end of the last line.
+  CHECK(same(text.get_coordinate_at_byte_offset(9), 3, 1));
+  CHECK(same(text.get_coordinate_at_byte_offset(100), 3, 1));
+
+  // Offsets follow edits.
+  text.set_cursor(text_coordinate_t(0, 1));
+  text.insert_char('x');
+  text.break_line();
+  CHECK(text.get_byte_size() == 11);
+  CHECK(text.get_byte_offset(text_coordinate_t(2, 2)) == 7);
+  CHECK(same(text.get_coordinate_at_byte_offset(3), 1, 0));
+}
+
+static std::string snapshot_text(const text_snapshot_t &snapshot) {
+  std::string result;
+  for (text_pos_t i = 0; i < snapshot.size(); ++i) {
+    const string_view line = snapshot.get_line(i);
+    if (i > 0) {
+      result += '\n';
+    }
+    result.append(line.data(), line.size());
+  }
+  return result;
+}
+
+static std::string written_text(const text_snapshot_t &snapshot) {
+  FILE *file = tmpfile();
+  if (file == nullptr || snapshot.write_to_fd(fileno(file)) != 0) {
+    return "<error>";
+  }
+  std::string result;
+  rewind(file);
+  int c;
+  while ((c = getc(file)) != EOF) {
+    result += static_cast<char>(c);
+  }
+  fclose(file);
+  return result;
+}
+
+static void test_snapshots() {
+  std::string contents;
+  for (int i = 0; i < 2000; ++i) {
+    contents += "line " + std::to_string(i) + "\n";
+  }
+  contents += "last";
+
+  std::unique_ptr<text_buffer_t> text(new text_buffer_t());
+  text->append_text(contents);
+  std::shared_ptr<const text_snapshot_t> snapshot = text->create_snapshot();
+
+  // Edit the text in several ways, including lines that are shared with the snapshot.
+  text->set_cursor(text_coordinate_t(0, 2));
+  text->insert_char('x');
+  text->break_line();
+  text->set_cursor(text_coordinate_t(1000, 0));
+  text->insert_block("new\nlines\n");
+  text->delete_block(text_coordinate_t(10, 0), text_coordinate_t(500, 3));
+  text->set_cursor(text_coordinate_t(text->size() - 1, 0));
+  text->merge(true);
+  std::shared_ptr<const text_snapshot_t> second = text->create_snapshot();
+  text->set_cursor(text_coordinate_t(0, 0));
+  text->insert_char('y');
+
+  CHECK(snapshot->size() == 2001);
+  CHECK(snapshot_text(*snapshot) == contents);
+  CHECK(written_text(*snapshot) == contents);
+  CHECK(second->size() == text->size());
+  CHECK(second->get_line(0) == string_view("lix"));
+  CHECK(text->get_line_data(0).get_view() == string_view("ylix"));
+
+  // Snapshots may outlive the text.
+  text.reset();
+  CHECK(snapshot_text(*snapshot) == contents);
+}
+
+// A snapshot released on another thread hands its nodes and line storage back to the text, which
+// then modifies them in place. The thread only signals the release through a relaxed store, such
+// that running this test under ThreadSanitizer (SANITIZE=thread unittests.sh) checks that the
+// release itself orders the reads of the snapshot before the modifications.
+static void test_snapshot_release() {
+  std::string contents;
+  for (int i = 0; i < 2000; ++i) {
+    contents += "line " + std::to_string(i) + "\n";
+  }
+  // Long enough to be stored in storage shared between copies of the line.
+  contents += std::string(100000, 'x');
+
+  text_buffer_t text;
+  text.append_text(contents);
+  const text_pos_t last = text.size() - 1;
+  for (int i = 0; i < 10; ++i) {
+    std::shared_ptr<const text_snapshot_t> snapshot = text.create_snapshot();
+    const std::string expected = snapshot_text(*snapshot);
+    // Copies the leaf holding the last line, after which the copy shares its storage.
+    text.set_cursor(text_coordinate_t(last - 1, 0));
+    text.insert_char('a');
+
+    std::atomic<bool> released(false);
+    std::string read;
+    std::thread reader([&] {
+      read = snapshot_text(*snapshot);
+      snapshot.reset();
+      released.store(true, std::memory_order_relaxed);
+    });
+    while (!released.load(std::memory_order_relaxed)) {
+      std::this_thread::yield();
+    }
+    text.set_cursor(text_coordinate_t(last, 0));
+    text.insert_char('b');
+    text.set_cursor(text_coordinate_t(i * 150, 0));
+    text.insert_char('c');
+    reader.join();
+    CHECK(read == expected);
+  }
+  CHECK(text.get_line_data(last - 1).get_view().substr(0, 11) == string_view("aaaaaaaaaal"));
+  CHECK(text.get_line_data(last).size() == 100010);
+}
+
+static bool same_change(const text_change_t &change, uint64_t sequence, text_coordinate_t start,
+                        text_coordinate_t old_end, text_coordinate_t new_end,
+                        text_pos_t deleted_bytes, text_pos_t inserted_bytes) {
+  return change.sequence == sequence && change.start == start && change.old_end == old_end &&
+         change.new_end == new_end && change.deleted_bytes == deleted_bytes &&
+         change.inserted_bytes == inserted_bytes;
+}
+
+static void test_changes() {
+  text_buffer_t text;
+  text.append_text("abc\ndef\nghi");
+  std::vector<text_change_t> changes;
+  text.connect_text_changed([&](const text_change_t &change) { changes.push_back(change); });
+  const uint64_t start_sequence = text.get_change_sequence();
+  const uint64_t unchanged_generation = text.get_line_generation(2);
+  CHECK(unchanged_generation <= start_sequence);
+
+  text.set_cursor(text_coordinate_t(0, 1));
+  text.insert_char('x');
+  CHECK(changes.size() == 1 &&
+        same_change(changes.back(), start_sequence + 1, text_coordinate_t(0, 1),
+                    text_coordinate_t(0, 1), text_coordinate_t(0, 2), 0, 1));
+  CHECK(text.get_change_sequence() == start_sequence + 1);
+  CHECK(text.get_line_generation(0) == start_sequence + 1);
+  CHECK(text.get_line_generation(1) == unchanged_generation);
+
+  // Breaking a line changes both halves, but only moves the lines after it.
+  text.break_line();
+  CHECK(changes.size() == 2 &&
+        same_change(changes.back(), start_sequence + 2, text_coordinate_t(0, 2),
+                    text_coordinate_t(0, 2), text_coordinate_t(1, 0), 0, 1));
+  CHECK(text.get_line_generation(0) == start_sequence + 2);
+  CHECK(text.get_line_generation(1) == start_sequence + 2);
+  CHECK(text.get_line_generation(2) == unchanged_generation);
+
+  // Merge the lines again, deleting the line separator.
+  text.merge(true);
+  CHECK(changes.size() == 3 &&
+        same_change(changes.back(), start_sequence + 3, text_coordinate_t(0, 2),
+                    text_coordinate_t(1, 0), text_coordinate_t(0, 2), 1, 0));
+  CHECK(text.size() == 3);
+
+  // Deleting "xbc\ndef\ng" from "axbc\ndef\nghi".
+  text.delete_block(text_coordinate_t(0, 1), text_coordinate_t(2, 1));
+  CHECK(changes.size() == 4 &&
+        same_change(changes.back(), start_sequence + 4, text_coordinate_t(0, 1),
+                    text_coordinate_t(2, 1), text_coordinate_t(0, 1), 9, 0));
+  CHECK(text.size() == 1 && text.get_line_data(0).get_view() == string_view("ahi"));
+
+  // Lines inserted in the middle of a block get the generation of the change as well.
+  text.set_cursor(text_coordinate_t(0, 1));
+  text.insert_block("12\n345\n6");
+  CHECK(changes.size() == 5 &&
+        same_change(changes.back(), start_sequence + 5, text_coordinate_t(0, 1),
+                    text_coordinate_t(0, 1), text_coordinate_t(2, 1), 0, 8));
+  for (text_pos_t i = 0; i < 3; ++i) {
+    CHECK(text.get_line_generation(i) == start_sequence + 5);
+  }
+
+  // A block inserted beyond the end of a line is appended to it, and the change starts there.
+  text.set_cursor(text_coordinate_t(1, 10));
+  text.insert_block("7\n8");
+  CHECK(changes.size() == 6 &&
+        same_change(changes.back(), start_sequence + 6, text_coordinate_t(1, 3),
+                    text_coordinate_t(1, 3), text_coordinate_t(2, 1), 0, 3));
+  CHECK(text.size() == 4 && text.get_line_data(1).get_view() == string_view("3457") &&
+        text.get_line_data(2).get_view() == string_view("8") &&
+        text.get_line_data(3).get_view() == string_view("6hi"));
+  CHECK(text.get_byte_offset(text_coordinate_t(2, 1)) ==
+        text.get_byte_offset(text_coordinate_t(1, 3)) + 3);
+}
+
+// Returns whether lines [first, last) are stored without an edit buffer.
+static bool minimized(const text_buffer_t &text, text_pos_t first, text_pos_t last) {
+  for (text_pos_t i = first; i < last; ++i) {
+    if (text.get_line_data(i).get_gap_position() >= 0) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Block operations return the lines they modify to their compact representation, except for the
+// line being edited.
+static void test_minimized_lines() {
+  text_buffer_t text;
+  for (int i = 0; i < 100; ++i) {
+    text.append_text("line " + std::to_string(i) + "\n");
+  }
+  text.set_cursor(text_coordinate_t(0, 2));
+  text.insert_char('x');
+  CHECK(!minimized(text, 0, 1));
+
+  text.set_cursor(text_coordinate_t(5, 2));
+  text.insert_block("a\nb\nc");
+  CHECK(minimized(text, 1, text.size()));
+
+  text.set_cursor(text_coordinate_t(10, 0));
+  text.set_selection_mode(selection_mode_t::SHIFT);
+  text.set_cursor(text_coordinate_t(20, 0));
+  text.set_selection_end(false);
+  text.indent_selection(8, false);
+  CHECK(text.get_line_data(19).get_view() == string_view("\tline 17"));
+  CHECK(minimized(text, 1, text.size()));
+
+  text.set_selection_mode(selection_mode_t::NONE);
+  text.set_cursor(text_coordinate_t(30, 0));
+  text.merge(true);
+  text.delete_block(text_coordinate_t(40, 2), text_coordinate_t(42, 3));
+  CHECK(minimized(text, 1, text.size()));
+  // The line being edited keeps its buffer.
+  CHECK(!minimized(text, 0, 1));
+}
+
+// Returns whether the file @p name is mapped into memory, according to /proc/self/maps.
+static bool is_mapped(const std::string &name) {
+  std::ifstream maps("/proc/self/maps");
+  std::string line;
+  while (std::getline(maps, line)) {
+    if (line.find(name) != std::string::npos) {
+      return true;
+    }
+  }
+  return false;
+}
+
+static void edit(text_buffer_t *text) {
+  text->set_cursor(text_coordinate_t(10, 3));
+  text->insert_char('x');
+  text->delete_block(text_coordinate_t(20, 2), text_coordinate_t(30, 4));
+  text->set_cursor(text_coordinate_t(40, 0));
+  text->merge(true);
+  text->set_cursor(text_coordinate_t(50, 1));
+  text->insert_block("new\ntext");
+  text->set_cursor(text_coordinate_t(text->size() - 1, 2));
+  text->insert_char('y');
+}
+
+// Lines appended with append_file refer to a mapping of the file. Edited lines are copied, and the
+// mapping is kept until the text and the snapshots referring to it are destroyed.
+static void test_mapped_file() {
+  std::string contents;
+  for (int i = 0; i < 3000; ++i) {
+    contents += "mapped line " + std::to_string(i) + "\n";
+  }
+  contents += "last";
+  char name[] = "/tmp/textbuffer_testXXXXXX";
+  const int fd = mkstemp(name);
+  CHECK(fd >= 0 && write(fd, contents.data(), contents.size()) ==
+                       static_cast<ssize_t>(contents.size()));
+  close(fd);
+
+  std::unique_ptr<text_buffer_t> text(new text_buffer_t());
+  CHECK(text->append_file(name) == 0);
+  text_buffer_t reference;
+  reference.append_text(contents);
+  edit(text.get());
+  edit(&reference);
+  const std::string expected = snapshot_text(*reference.create_snapshot());
+  std::shared_ptr<const text_snapshot_t> snapshot = text->create_snapshot();
+  CHECK(snapshot_text(*snapshot) == expected);
+
+  // Replacing the file does not change the text.
+  CHECK(text->save_file(name) == 0);
+  CHECK(snapshot_text(*text->create_snapshot()) == expected);
+  CHECK(written_text(*snapshot) == expected);
+
+  // The snapshot keeps the mapping after the text is destroyed.
+  text.reset();
+  CHECK(snapshot_text(*snapshot) == expected);
+#ifdef HAS_MMAP
+  CHECK(is_mapped(name));
+#endif
+  snapshot.reset();
+  CHECK(!is_mapped(name));
+  unlink(name);
+}
+
+static std::string file_contents(const std::string &name) {
+  std::ifstream file(name, std::ios::binary);
+  return std::string(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+}
+
+static mode_t file_mode(const std::string &name) {
+  struct stat file_info;
+  return stat(name.c_str(), &file_info) == 0 ? file_info.st_mode & 07777 : 0;
+}
+
+// Saving replaces the file through a temporary file, keeping the permissions of the existing file
+// and the symbolic links pointing to it. If writing fails, the existing file is left unchanged.
+static void test_save_file() {
+  char name[] = "/tmp/textbuffer_testXXXXXX";
+  const int fd = mkstemp(name);
+  CHECK(fd >= 0 && write(fd, "old", 3) == 3);
+  close(fd);
+  CHECK(chmod(name, 0640) == 0);
+  const std::string link_name = std::string(name) + ".link";
+  CHECK(symlink(name, link_name.c_str()) == 0);
+
+  text_buffer_t text;
+  text.append_text("first\nsecond\n\nlast");
+  CHECK(text.save_file(link_name, line_ending_t::CRLF) == 0);
+  CHECK(file_contents(name) == "first\r\nsecond\r\n\r\nlast");
+  CHECK(file_mode(name) == 0640);
+  char target[sizeof(name) + 1] = {0};
+  CHECK(readlink(link_name.c_str(), target, sizeof(target) - 1) > 0 &&
+        std::string(target) == name);
+
+  text.set_cursor(text_coordinate_t(3, 4));
+  text.insert_char('!');
+  CHECK(text.save_file(name) == 0);
+  CHECK(file_contents(name) == "first\nsecond\n\nlast!");
+  CHECK(file_mode(name) == 0640);
+
+  // Exceeding the file size limit makes writev write only part of the data before failing.
+  text_buffer_t large;
+  large.append_text(std::string(100000, 'x') + "\nend");
+  struct rlimit old_limit, limit;
+  getrlimit(RLIMIT_FSIZE, &old_limit);
+  limit = old_limit;
+  limit.rlim_cur = 50000;
+  signal(SIGXFSZ, SIG_IGN);
+  CHECK(setrlimit(RLIMIT_FSIZE, &limit) == 0);
+  CHECK(large.save_file(name) == EFBIG);
+  setrlimit(RLIMIT_FSIZE, &old_limit);
+  signal(SIGXFSZ, SIG_DFL);
+  CHECK(file_contents(name) == "first\nsecond\n\nlast!");
+  CHECK(file_mode(name) == 0640);
+
+  unlink(link_name.c_str());
+  unlink(name);
+}
+
+static void ignore_signal(int) {}
+
+// Writes that are interrupted by a signal after writing part of the data are continued. The writes
+// go to a pipe which is read slowly, such that the writer is blocked when the timer signal arrives.
+static void test_interrupted_writes() {
+  text_buffer_t text;
+  std::string contents;
+  for (int i = 0; contents.size() < 4000000; ++i) {
+    contents += "line " + std::to_string(i) + std::string(i % 100, 'x') + "\n";
+  }
+  contents += "last";
+  text.append_text(contents);
+
+  int pipe_fds[2];
+  CHECK(pipe(pipe_fds) == 0);
+  sigset_t alarm_set, old_set;
+  sigemptyset(&alarm_set);
+  sigaddset(&alarm_set, SIGALRM);
+  // The reader thread blocks the signal, such that it is delivered to the writing thread.
+  pthread_sigmask(SIG_BLOCK, &alarm_set, &old_set);
+  std::string read_data;
+  std::thread reader([&]() {
+    char buffer[16384];
+    ssize_t result;
+    while ((result = read(pipe_fds[0], buffer, sizeof(buffer))) > 0) {
+      read_data.append(buffer, result);
+      std::this_thread::sleep_for(std::chrono::microseconds(20));
+    }
+  });
+  pthread_sigmask(SIG_SETMASK, &old_set, nullptr);
+
+  struct sigaction action, old_action;
+  action.sa_handler = ignore_signal;
+  sigemptyset(&action.sa_mask);
+  // Without SA_RESTART, a blocked writev returns the number of bytes written so far.
+  action.sa_flags = 0;
+  sigaction(SIGALRM, &action, &old_action);
+  struct itimerval timer = {{0, 500}, {0, 500}}, no_timer = {{0, 0}, {0, 0}};
+  setitimer(ITIMER_REAL, &timer, nullptr);
+  const int error = text.write_to_fd(pipe_fds[1], line_ending_t::CRLF);
+  setitimer(ITIMER_REAL, &no_timer, nullptr);
+  sigaction(SIGALRM, &old_action, nullptr);
+  close(pipe_fds[1]);
+  reader.join();
+  close(pipe_fds[0]);
+
+  CHECK(error == 0);
+  std::string expected;
+  for (char c : contents) {
+    if (c == '\n') {
+      expected += '\r';
+    }
+    expected += c;
+  }
+  CHECK(read_data == expected);
+}
+
+static text_coordinate_t random_coordinate(const text_buffer_t &text) {
+  const text_pos_t line = std::rand() % text.size();
+  return text_coordinate_t(line, std::rand() % (text.get_line_size(line) + 1));
+}
+
+// The chunks returned by get_block_chunks refer to the lines, and joined form the same text as
+// convert_block returns, in either order of the end points.
+static void test_block_chunks() {
+  text_buffer_t text;
+  std::string contents;
+  for (int i = 0; i < 200; ++i) {
+    contents += std::string(std::rand() % 4 == 0 ? 0 : std::rand() % 40, 'a' + i % 26) + "\n";
+  }
+  text.append_text(contents);
+
+  for (int i = 0; i < 1000; ++i) {
+    const text_coordinate_t start = random_coordinate(text);
+    text_coordinate_t end = random_coordinate(text);
+    if (i % 10 == 0) {
+      end = text_coordinate_t(start.line, std::rand() % (text.get_line_size(start.line) + 1));
+    }
+    const std::unique_ptr<std::string> block = text.convert_block(start, end);
+    std::string joined;
+    for (const string_view &chunk : text.get_block_chunks(start, end)) {
+      joined.append(chunk.data(), chunk.size());
+    }
+    CHECK(joined == (block == nullptr ? std::string() : *block));
+
+    // Edits in between move the gap of the edited line, which the chunks must not include.
+    if (i % 7 == 0) {
+      text.set_cursor(random_coordinate(text));
+      text.insert_char('x');
+    }
+  }
+
+  // Lines in the middle of the block are returned without copying.
+  const std::vector<string_view> chunks =
+      text.get_block_chunks(text_coordinate_t(10, 0), text_coordinate_t(20, 0));
+  CHECK(chunks.size() == 21);
+  CHECK(chunks[2].data() == text.get_line_data(11).get_view().data());
+}
+
+int main(int, char **) {
+  test_byte_offsets();
+  test_snapshots();
+  test_snapshot_release();
+  test_changes();
+  test_minimized_lines();
+  test_mapped_file();
+  test_save_file();
+  test_interrupted_writes();
+  test_block_chunks();
+  return unittest_result();
+}
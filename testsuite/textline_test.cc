@@ -0,0 +1,569 @@
+/* Copyright (C) 2018 G.P. Halkes
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License version 3, as
+   published by the Free Software Foundation.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Test editing a text_line_t against a std::string holding the same text. Edits at random
+// positions are interleaved with reads, such that the gap in the buffer of the line is moved
+// around and closed in between edits.
+
+#include <algorithm>
+#include <cstdlib>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "t3widget/internal.h"
+#include "t3widget/textline.h"
+#include "unittest.h"
+
+using namespace t3widget;
+
+// Characters of one, two and three bytes in UTF-8.
+static const key_t keys[] = {'a', 'z', ' ', 0xe9, 0x4e2d};
+static const char *const key_strings[] = {"a", "z", " ", "\xc3\xa9", "\xe4\xb8\xad"};
+
+static size_t char_length(const std::string &text, size_t pos) {
+  const unsigned char c = text[pos];
+  return c < 0x80 ? 1 : c < 0xe0 ? 2 : 3;
+}
+
+// Returns a random position in @p text that is not inside a character.
+static size_t random_position(const std::string &text) {
+  size_t pos = 0, result = 0, count = 1;
+  while (pos < text.size()) {
+    pos += char_length(text, pos);
+    if (std::rand() % ++count == 0) {
+      result = pos;
+    }
+  }
+  return result;
+}
+
+static bool equal(const text_line_t &line, const std::string &model) {
+  const string_view view = line.get_view();
+  return line.size() == static_cast<text_pos_t>(model.size()) &&
+         std::string(view.data(), view.size()) == model;
+}
+
+static void test_edits() {
+  text_line_t line;
+  std::string model;
+
+  for (int i = 0; i < 20000; ++i) {
+    const int key_idx = std::rand() % 5;
+    const size_t pos = random_position(model);
+    switch (std::rand() % 10) {
+      case 0:
+      case 1:
+      case 2:
+      case 3:
+        CHECK(line.insert_char(pos, keys[key_idx], nullptr));
+        model.insert(pos, key_strings[key_idx]);
+        break;
+      case 4:
+        CHECK(line.append_char(keys[key_idx], nullptr));
+        model += key_strings[key_idx];
+        break;
+      case 5:
+        if (pos < model.size()) {
+          CHECK(line.delete_char(pos, nullptr));
+          model.erase(pos, char_length(model, pos));
+        }
+        break;
+      case 6:
+        if (pos > 0) {
+          const size_t start = line.adjust_position(pos, -1);
+          CHECK(line.backspace_char(pos, nullptr));
+          model.erase(start, pos - start);
+        }
+        break;
+      case 7:
+        if (pos < model.size()) {
+          CHECK(line.overwrite_char(pos, keys[key_idx], nullptr));
+          model.replace(pos, char_length(model, pos), key_strings[key_idx]);
+        }
+        break;
+      case 8:
+        // Reading part of the line only moves the gap if needed.
+        if (pos < model.size()) {
+          CHECK(line.adjust_position(pos, 1) ==
+                static_cast<text_pos_t>(pos + char_length(model, pos)));
+        }
+        break;
+      case 9:
+        CHECK(equal(line, model));
+        if (std::rand() % 2 == 0) {
+          CHECK(line.get_data() == model);
+        }
+        break;
+    }
+    if (model.size() > 2000) {
+      size_t half = 0;
+      while (half < model.size() / 2) {
+        half += char_length(model, half);
+      }
+      std::unique_ptr<text_line_t> tail = line.break_line(half);
+      CHECK(equal(*tail, model.substr(half)));
+      model.erase(half);
+    }
+  }
+  CHECK(equal(line, model));
+}
+
+static void test_split_merge() {
+  text_line_t line;
+  std::string model;
+  for (int i = 0; i < 100; ++i) {
+    const int key_idx = std::rand() % 5;
+    const size_t pos = random_position(model);
+    line.insert_char(pos, keys[key_idx], nullptr);
+    model.insert(pos, key_strings[key_idx]);
+  }
+
+  // Edits that leave a gap in the middle of the buffer, followed by structural changes.
+  const size_t pos = random_position(model);
+  line.insert_char(pos, 'x', nullptr);
+  model.insert(pos, "x");
+  std::unique_ptr<text_line_t> tail = line.break_line(pos);
+  CHECK(equal(line, model.substr(0, pos)));
+  CHECK(equal(*tail, model.substr(pos)));
+
+  tail->insert_char(0, 'y', nullptr);
+  line.merge(std::move(tail));
+  model.insert(pos, "y");
+  CHECK(equal(line, model));
+
+  const size_t cut = random_position(model);
+  line.insert_char(cut, 'z', nullptr);
+  model.insert(cut, "z");
+  std::unique_ptr<text_line_t> part = line.cut_line(cut, cut + 1);
+  CHECK(equal(*part, "z"));
+  model.erase(cut, 1);
+  CHECK(equal(line, model));
+
+  std::unique_ptr<text_line_t> copy = line.clone(0, line.size());
+  line.insert_char(0, 'w', nullptr);
+  CHECK(equal(*copy, model));
+  line.insert(std::move(part), 1);
+  CHECK(equal(line, "wz" + model));
+
+  // get_data returns a copy, which is not affected by later modifications.
+  const std::string data = line.get_data();
+  line.set_text("replaced");
+  CHECK(data == "wz" + model);
+  CHECK(equal(line, "replaced"));
+}
+
+// Reading a line while it is being edited must not move the gap in its buffer, as that would move
+// the rest of the line for every edit. The results must be the same as for a line without a gap.
+static void test_readers_keep_gap() {
+  // Tabs, multibyte and combining characters, such that the general code paths are used.
+  static const char *const parts[] = {"word ", "\t", "\xc3\xa9", "e\xcc\x81", "\xe4\xb8\xad", "  "};
+  std::string model;
+  while (model.size() < 20000) {
+    model += parts[std::rand() % 6];
+  }
+  text_line_t line(model);
+
+  for (int i = 0; i < 200; ++i) {
+    std::unique_ptr<text_line_t> reference(new text_line_t(model));
+    const text_pos_t pos = reference->adjust_position(random_position(model), 0);
+    CHECK(line.insert_char(pos, 'x', nullptr));
+    model.insert(pos, "x");
+    reference.reset(new text_line_t(model));
+    const text_pos_t gap = line.get_gap_position();
+    CHECK(gap == pos + 1);
+
+    for (int j = 0; j < 10; ++j) {
+      const text_pos_t near = std::min<text_pos_t>(
+          std::max<text_pos_t>(pos + std::rand() % 100 - 50, 0), model.size());
+      const text_pos_t at = reference->adjust_position(near, 0);
+      CHECK(line.calculate_screen_width(0, at, 8) == reference->calculate_screen_width(0, at, 8));
+      CHECK(line.calculate_screen_width(at, at + 40, 4) ==
+            reference->calculate_screen_width(at, at + 40, 4));
+      const text_pos_t column = reference->calculate_screen_width(0, at, 8) + std::rand() % 20;
+      CHECK(line.calculate_line_pos(0, model.size(), column, 8) ==
+            reference->calculate_line_pos(0, model.size(), column, 8));
+      const text_line_t::break_pos_t line_break = line.find_next_break_pos(at, 29, 8);
+      const text_line_t::break_pos_t reference_break = reference->find_next_break_pos(at, 29, 8);
+      CHECK(line_break.pos == reference_break.pos && line_break.flags == reference_break.flags);
+      for (int adjust = -1; adjust <= 1; ++adjust) {
+        CHECK(line.adjust_position(at, adjust) == reference->adjust_position(at, adjust));
+      }
+      CHECK(line.width_at(at) == reference->width_at(at));
+      CHECK(line.is_print(at) == reference->is_print(at));
+      CHECK(line.is_space(at) == reference->is_space(at));
+      CHECK(line.get_next_word(at) == reference->get_next_word(at));
+      CHECK(line.get_previous_word(at) == reference->get_previous_word(at));
+    }
+    CHECK(line.get_gap_position() == gap);
+  }
+  CHECK(equal(line, model));
+}
+
+// Runs of printable ASCII characters are measured 16 or 32 bytes at a time where the target
+// supports it. The width must be the same as counting one column per character, for runs ending at
+// every position within the vector size, at different offsets from the start of the buffer.
+static void test_ascii_runs() {
+  static const key_t stops[] = {'\t', 0x01, 0x7f, 0xe9};
+  static const char *const stop_strings[] = {"\t", "\x01", "\x7f", "\xc3\xa9"};
+  bool widths_equal = true, positions_equal = true;
+  for (int stop = 0; stop < 4; ++stop) {
+    const text_pos_t stop_width = text_line_t(stop_strings[stop]).calculate_screen_width(0, 4, 8);
+    for (text_pos_t offset = 0; offset < 34; ++offset) {
+      for (text_pos_t run = 0; run <= 64; ++run) {
+        // The run includes the first and last printable characters.
+        std::string text = std::string(offset, '~') + std::string(run, ' ');
+        for (text_pos_t i = 0; i < run; i += 7) {
+          text[offset + i] = 'a' + i % 26;
+        }
+        const text_pos_t end = offset + run;
+        const text_pos_t columns = stops[stop] == '\t' ? 8 - end % 8 : stop_width;
+        const text_pos_t expected = end + columns + 3;
+
+        text_line_t line(text + stop_strings[stop] + "xyz");
+        // The same text with the gap directly after the character ending the run.
+        text_line_t edited(text + "xyz");
+        CHECK(edited.insert_char(end, stops[stop], nullptr));
+        for (const text_line_t *checked : {&line, &edited}) {
+          widths_equal = widths_equal &&
+                         checked->calculate_screen_width(0, end, 8) == end &&
+                         checked->calculate_screen_width(0, checked->size(), 8) == expected;
+          positions_equal = positions_equal &&
+                            checked->calculate_line_pos(0, checked->size(), end, 8) == end &&
+                            checked->calculate_line_pos(0, checked->size(), expected - 1, 8) ==
+                                checked->size() - 1;
+        }
+      }
+    }
+  }
+  CHECK(widths_equal);
+  CHECK(positions_equal);
+}
+
+// Returns the screen column at the start of each character of @p line, and at its end, by adding
+// the widths of the characters one by one.
+static std::vector<text_pos_t> linear_columns(const text_line_t &line, const std::string &model,
+                                              int tabsize) {
+  std::vector<text_pos_t> columns(model.size() + 1, -1);
+  text_pos_t column = 0;
+  for (size_t pos = 0; pos < model.size(); pos += char_length(model, pos)) {
+    columns[pos] = column;
+    column += model[pos] == '\t' ? tabsize - column % tabsize : line.width_at(pos);
+  }
+  columns[model.size()] = column;
+  return columns;
+}
+
+// Calculations from the start of long lines continue from column checkpoints. The results must be
+// the same as adding the widths of all characters, also after edits and tab size changes.
+static void test_column_checkpoints() {
+  static const char *const parts[] = {"word ", "\t", "\xc3\xa9", "e\xcc\x81", "\xe4\xb8\xad",
+                                      "\x01", "x\t\t"};
+  std::string model;
+  while (model.size() < 40000) {
+    model += parts[std::rand() % 7];
+  }
+  text_line_t line(model);
+
+  bool widths_equal = true, positions_equal = true;
+  for (int round = 0; round < 40; ++round) {
+    const int tabsize = round % 5 == 4 ? 3 : 8;
+    const std::vector<text_pos_t> columns = linear_columns(line, model, tabsize);
+    std::vector<size_t> starts;
+    for (size_t pos = 0; pos < model.size(); pos += char_length(model, pos)) {
+      starts.push_back(pos);
+    }
+    for (int i = 0; i < 200; ++i) {
+      text_pos_t pos = std::rand() % (model.size() + 1);
+      while (columns[pos] < 0) {
+        --pos;
+      }
+      widths_equal = widths_equal && line.calculate_screen_width(0, pos, tabsize) == columns[pos];
+
+      // The position of a column is the character that covers it.
+      const text_pos_t column = std::rand() % (columns.back() + 2);
+      const auto covering = std::partition_point(starts.begin(), starts.end(), [&](size_t start) {
+        return columns[start + char_length(model, start)] <= column;
+      });
+      const text_pos_t expected = covering == starts.end() ? model.size() : *covering;
+      positions_equal = positions_equal &&
+                        line.calculate_line_pos(0, model.size(), column, tabsize) == expected;
+    }
+
+    // Edits before, in between and after the checkpoints.
+    const text_pos_t pos = line.adjust_position(random_position(model), 0);
+    const int key_idx = std::rand() % 5;
+    CHECK(line.insert_char(pos, keys[key_idx], nullptr));
+    model.insert(pos, key_strings[key_idx]);
+    if (round % 3 == 0) {
+      model.erase(0, line.adjust_position(0, 1));
+      CHECK(line.delete_char(0, nullptr));
+    }
+  }
+  CHECK(widths_equal);
+  CHECK(positions_equal);
+  CHECK(equal(line, model));
+}
+
+static std::string long_text(size_t size) {
+  std::string result;
+  while (result.size() < size) {
+    result += "long line " + std::to_string(result.size()) + " ";
+  }
+  return result;
+}
+
+// Parts of long lines split off by break_line or copied by clone refer to the same storage. Editing
+// one of the lines must not change the others, also once the other lines are gone and the edited
+// line takes over the storage.
+static void test_shared_slices() {
+  const std::string model = long_text(300000);
+  const size_t half = 120000;
+  text_line_t line(model);
+  const char *const storage = line.get_view().data();
+
+  std::unique_ptr<text_line_t> tail = line.break_line(half);
+  CHECK(tail->get_view().data() == storage + half);
+  CHECK(line.get_view().data() == storage);
+  std::unique_ptr<text_line_t> copy = tail->clone(0, tail->size());
+  CHECK(copy->get_view().data() == storage + half);
+  std::unique_ptr<text_line_t> middle = tail->clone(1000, 100000);
+  CHECK(middle->get_view().data() == storage + half + 1000);
+
+  // Editing the tail copies it, leaving the storage for the other lines unchanged.
+  std::string tail_model = model.substr(half);
+  CHECK(tail->insert_char(5, 'x', nullptr));
+  tail_model.insert(5, "x");
+  CHECK(tail->delete_char(2000, nullptr));
+  tail_model.erase(2000, 1);
+  CHECK(equal(*tail, tail_model));
+  CHECK(equal(*copy, model.substr(half)));
+  CHECK(equal(*middle, model.substr(half + 1000, 99000)));
+  CHECK(equal(line, model.substr(0, half)));
+
+  // The same when editing the first part of the line.
+  std::string line_model = model.substr(0, half);
+  CHECK(line.append_char('y', nullptr));
+  line_model += "y";
+  CHECK(line.overwrite_char(10, 'z', nullptr));
+  line_model.replace(10, 1, "z");
+  CHECK(equal(line, line_model));
+  CHECK(equal(*copy, model.substr(half)));
+  CHECK(equal(*middle, model.substr(half + 1000, 99000)));
+
+  // Once the other lines are deleted, the remaining slice is the only one using the storage.
+  copy.reset();
+  std::string middle_model = model.substr(half + 1000, 99000);
+  CHECK(middle->insert_char(0, 'w', nullptr));
+  middle_model.insert(0, "w");
+  CHECK(middle->append_char('v', nullptr));
+  middle_model += "v";
+  CHECK(equal(*middle, middle_model));
+  CHECK(equal(*tail, tail_model));
+  CHECK(equal(line, line_model));
+
+  line.merge(std::move(tail));
+  CHECK(equal(line, line_model + tail_model));
+}
+
+// The word motions as implemented before caching the character class runs, which check the class
+// of each character.
+static text_pos_t reference_next_word(const text_line_t &line, text_pos_t start) {
+  const string_view data = line.get_view();
+  int cclass = CLASS_WHITESPACE, new_class;
+  if (start < 0) {
+    start = 0;
+  } else {
+    cclass = get_class(data, start);
+    start = line.adjust_position(start, 1);
+  }
+  text_pos_t i;
+  for (i = start; i < line.size() &&
+                  ((new_class = get_class(data, i)) == cclass || new_class == CLASS_WHITESPACE);
+       i = line.adjust_position(i, 1)) {
+    cclass = new_class;
+  }
+  return i >= line.size() ? -1 : i;
+}
+
+static text_pos_t reference_previous_word(const text_line_t &line, text_pos_t start) {
+  const string_view data = line.get_view();
+  if (start == 0) {
+    return -1;
+  } else if (start < 0) {
+    start = line.size();
+  }
+  text_pos_t i;
+  int cclass = CLASS_WHITESPACE;
+  for (i = line.adjust_position(start, -1);
+       i > 0 && (cclass = get_class(data, i)) == CLASS_WHITESPACE;
+       i = line.adjust_position(i, -1)) {
+  }
+  if (i == 0 && cclass == CLASS_WHITESPACE) {
+    return -1;
+  }
+  text_pos_t result = i;
+  for (i = line.adjust_position(i, -1); i > 0 && get_class(data, i) == cclass;
+       i = line.adjust_position(i, -1)) {
+    result = i;
+  }
+  if (i == 0 && get_class(data, i) == cclass) {
+    result = i;
+  }
+  return cclass != CLASS_WHITESPACE ? result : -1;
+}
+
+static text_pos_t reference_next_boundary(const text_line_t &line, text_pos_t start) {
+  const string_view data = line.get_view();
+  const int cclass = get_class(data, start);
+  text_pos_t i;
+  for (i = line.adjust_position(start, 1); i < line.size() && get_class(data, i) == cclass;
+       i = line.adjust_position(i, 1)) {
+  }
+  return i;
+}
+
+static text_pos_t reference_previous_boundary(const text_line_t &line, text_pos_t start) {
+  const string_view data = line.get_view();
+  if (start <= 0) {
+    return 0;
+  }
+  const int cclass = get_class(data, start);
+  text_pos_t result = start, i;
+  for (i = line.adjust_position(start, -1); i > 0 && get_class(data, i) == cclass;
+       i = line.adjust_position(i, -1)) {
+    result = i;
+  }
+  return i == 0 && get_class(data, i) == cclass ? 0 : result;
+}
+
+// Word motions skip whole runs of characters of the same class. The runs are computed in parts for
+// long lines, and are recomputed after edits. The motions must stop at the same positions as when
+// checking each character.
+static void test_word_motions() {
+  static const char *const parts[] = {"word", "\xc3\xa9t\xc3\xa9", " ", "\t", "+-", "()",
+                                      "e\xcc\x81", "\xe4\xb8\xad", "\x01", "_9"};
+  std::string model;
+  while (model.size() < 20000) {
+    const int part = std::rand() % 10;
+    // Some runs are longer than the parts in which the runs are computed.
+    const int repeat = std::rand() % 50 == 0 ? 1200 : 1 + std::rand() % 3;
+    for (int i = 0; i < repeat; ++i) {
+      model += parts[part];
+    }
+  }
+  text_line_t line(model);
+
+  bool next_equal = true, previous_equal = true, boundaries_equal = true;
+  for (int round = 0; round < 20; ++round) {
+    for (int i = 0; i < 100; ++i) {
+      const text_pos_t pos =
+          i == 0 ? 0 : i == 1 ? line.size() : line.adjust_position(random_position(model), 0);
+      next_equal = next_equal && line.get_next_word(pos) == reference_next_word(line, pos);
+      previous_equal =
+          previous_equal && line.get_previous_word(pos) == reference_previous_word(line, pos);
+      if (pos < line.size()) {
+        boundaries_equal = boundaries_equal &&
+                           line.get_next_word_boundary(pos) == reference_next_boundary(line, pos) &&
+                           line.get_previous_word_boundary(pos) ==
+                               reference_previous_boundary(line, pos);
+      }
+    }
+    next_equal = next_equal && line.get_next_word(-1) == reference_next_word(line, -1);
+    previous_equal =
+        previous_equal && line.get_previous_word(-1) == reference_previous_word(line, -1);
+
+    // Edits that split, join and extend runs.
+    const text_pos_t pos = line.adjust_position(random_position(model), 0);
+    const key_t key = round % 3 == 0 ? ' ' : round % 3 == 1 ? 'q' : '+';
+    CHECK(line.insert_char(pos, key, nullptr));
+    model.insert(pos, 1, static_cast<char>(key));
+    const text_pos_t erase = line.adjust_position(random_position(model), 0);
+    if (erase < line.size()) {
+      model.erase(erase, line.adjust_position(erase, 1) - erase);
+      CHECK(line.delete_char(erase, nullptr));
+    }
+  }
+  CHECK(next_equal);
+  CHECK(previous_equal);
+  CHECK(boundaries_equal);
+  CHECK(equal(line, model));
+}
+
+// A line class as a derived text_line_factory_t would create, which is larger than text_line_t.
+class derived_line_t : public text_line_t {
+ public:
+  explicit derived_line_t(string_view text) : text_line_t(text) {}
+  char extra[40];
+};
+
+// Lines allocated from an arena are returned to it when deleted and reused, while lines allocated
+// on the heap are deleted through the same operator delete.
+static void test_arena() {
+  CHECK(default_text_line_factory.get_arena() == nullptr);
+  text_line_factory_t factory(true);
+  text_line_arena_t *arena = factory.get_arena();
+  CHECK(arena != nullptr);
+
+  std::unique_ptr<text_line_t> line = factory.new_text_line_t("first");
+  const void *address = line.get();
+  line.reset();
+  line = factory.new_text_line_t("second");
+  CHECK(line.get() == address);
+  CHECK(equal(*line, "second"));
+
+  // Objects of different sizes are kept on different free lists.
+  std::unique_ptr<text_line_t> derived(new (arena) derived_line_t("derived"));
+  const void *derived_address = derived.get();
+  std::unique_ptr<text_line_t> heap(new derived_line_t("heap"));
+  std::unique_ptr<text_line_t> heap_base(new text_line_t("heap base"));
+  derived.reset();
+  heap.reset();
+  heap_base.reset();
+  std::unique_ptr<text_line_t> reused(new (arena) derived_line_t("reused"));
+  CHECK(reused.get() == derived_address);
+  CHECK(equal(*reused, "reused"));
+  CHECK(equal(*line, "second"));
+
+  // Enough lines to fill several blocks of the arena, with lines released in between.
+  std::vector<std::unique_ptr<text_line_t>> lines;
+  std::vector<std::string> model;
+  for (int i = 0; i < 20000; ++i) {
+    model.push_back(std::to_string(i) + std::string(i % 50, 'a'));
+    lines.push_back(factory.new_text_line_t(model.back()));
+    if (i % 3 == 0) {
+      const size_t idx = std::rand() % lines.size();
+      model[idx] = "replaced " + std::to_string(i);
+      lines[idx] = i % 2 == 0 ? factory.new_text_line_t(model[idx])
+                              : std::unique_ptr<text_line_t>(new text_line_t(model[idx]));
+    }
+  }
+  bool all_equal = true;
+  for (size_t i = 0; i < lines.size(); ++i) {
+    all_equal = all_equal && equal(*lines[i], model[i]);
+  }
+  CHECK(all_equal);
+}
+
+int main(int, char **) {
+  test_edits();
+  test_split_merge();
+  test_readers_keep_gap();
+  test_ascii_runs();
+  test_column_checkpoints();
+  test_shared_slices();
+  test_word_motions();
+  test_arena();
+  return unittest_result();
+}
@@ -0,0 +1,181 @@
+/* Copyright (C) 2018 G.P. Halkes
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License version 3, as
+   published by the Free Software Foundation.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Test loading files with text_loader_t. The file is read in chunks of 64 KiB, so the contents are
+// chosen such that lines and characters cross the chunk boundaries. As the tests do not run the
+// main loop, the lines read are appended by calling process_chunks.
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+#include "t3widget/textbuffer.h"
+#include "t3widget/textloader.h"
+#include "unittest.h"
+
+using namespace t3widget;
+
+static const size_t chunk_size = 65536;
+
+static std::string write_file(const std::string &contents) {
+  char name[] = "/tmp/textloader_testXXXXXX";
+  int fd = mkstemp(name);
+  if (fd < 0 ||
+      write(fd, contents.data(), contents.size()) != static_cast<ssize_t>(contents.size())) {
+    perror("Could not write test file");
+    exit(1);
+  }
+  close(fd);
+  return name;
+}
+
+static std::string text_contents(const text_buffer_t &text) {
+  std::string result;
+  for (text_pos_t i = 0; i < text.size(); ++i) {
+    const string_view line = text.get_line_data(i).get_view();
+    if (i > 0) {
+      result += '\n';
+    }
+    result.append(line.data(), line.size());
+  }
+  return result;
+}
+
+// Loads @p contents, and checks that the text is the same and that the signals report the progress.
+static void check_load(const std::string &contents) {
+  const std::string name = write_file(contents);
+  text_buffer_t text;
+  text_loader_t loader(&text);
+  int finished = -1, chunks = 0;
+  text_pos_t last_progress = 0, size = -2;
+  bool lines_in_order = true;
+  text_pos_t last_line = 0;
+  loader.connect_finished([&](int error) { finished = error; });
+  loader.connect_progress([&](text_pos_t bytes_read, text_pos_t file_size) {
+    ++chunks;
+    last_progress = bytes_read;
+    size = file_size;
+  });
+  loader.connect_lines_appended([&](text_pos_t line) {
+    lines_in_order = lines_in_order && line >= last_line;
+    last_line = line;
+  });
+
+  CHECK(loader.start(name) == 0);
+  CHECK(loader.is_loading());
+  while (finished < 0) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    loader.process_chunks();
+  }
+  CHECK(finished == 0);
+  CHECK(!loader.is_loading());
+  CHECK(text_contents(text) == contents);
+  CHECK(last_progress == static_cast<text_pos_t>(contents.size()));
+  CHECK(size == static_cast<text_pos_t>(contents.size()));
+  CHECK(chunks >= 1);
+  CHECK(lines_in_order);
+  unlink(name.c_str());
+}
+
+static void test_chunk_boundaries() {
+  check_load("");
+  check_load("no newline");
+  check_load("trailing newline\n");
+  check_load("\n\n\n");
+
+  // Newlines just before, at and just after the chunk boundary.
+  for (size_t offset : {chunk_size - 2, chunk_size - 1, chunk_size}) {
+    std::string contents(offset, 'a');
+    contents += "\nsecond line\n";
+    check_load(contents);
+    contents.pop_back();
+    check_load(contents);
+  }
+
+  // A line spanning several chunks, without a newline at the end.
+  check_load("first\n" + std::string(3 * chunk_size + 5, 'b'));
+
+  // Many short lines, such that each chunk ends with an incomplete line.
+  std::string contents;
+  for (int i = 0; contents.size() < 5 * chunk_size; ++i) {
+    contents += "line " + std::to_string(i) + "\n";
+  }
+  check_load(contents);
+}
+
+// Multi-byte characters split across the chunk boundary must be kept intact.
+static void test_split_characters() {
+  static const char *const characters[] = {"\xc3\xa9", "\xe4\xb8\xad", "\xf0\x9f\x98\x80"};
+  for (const char *character : characters) {
+    const size_t length = std::string(character).size();
+    for (size_t split = 1; split < length; ++split) {
+      std::string contents(chunk_size - split, 'c');
+      contents += character;
+      contents += "d\nnext";
+      check_load(contents);
+      // The same, with the character at the start of the line crossing the boundary.
+      contents = std::string(chunk_size - split - 1, 'c') + "\n" + character + "e";
+      check_load(contents);
+    }
+  }
+}
+
+// Cancelling stops appending lines, and does not emit the finished signal.
+static void test_cancel() {
+  std::string contents;
+  for (int i = 0; contents.size() < 200 * chunk_size; ++i) {
+    contents += "line " + std::to_string(i) + "\n";
+  }
+  const std::string name = write_file(contents);
+  text_buffer_t text;
+  text_loader_t loader(&text);
+  bool finished = false;
+  loader.connect_finished([&](int) { finished = true; });
+
+  CHECK(loader.start(name) == 0);
+  while (text.size() == 1) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    loader.process_chunks();
+  }
+  loader.cancel();
+  CHECK(!loader.is_loading());
+  const text_pos_t lines = text.size();
+  loader.process_chunks();
+  CHECK(text.size() == lines);
+  // The lines appended before cancelling are complete lines at the start of the file.
+  const std::string loaded = text_contents(text);
+  CHECK(loaded.size() < contents.size() && !finished);
+  CHECK(contents.compare(0, loaded.size(), loaded) == 0);
+  CHECK(contents[loaded.size() - 1] == '\n');
+
+  // The loader can be started again after cancelling, and appends to the text.
+  CHECK(loader.start(name) == 0);
+  while (!finished) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    loader.process_chunks();
+  }
+  CHECK(text_contents(text) == loaded + contents);
+  unlink(name.c_str());
+}
+
+int main(int, char **) {
+  test_chunk_boundaries();
+  test_split_characters();
+  test_cancel();
+  return unittest_result();
+}
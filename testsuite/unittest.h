@@ -0,0 +1,34 @@
+/* Copyright (C) 2018 G.P. Halkes
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License version 3, as
+   published by the Free Software Foundation.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef T3_WIDGET_UNITTEST_H
+#define T3_WIDGET_UNITTEST_H
+
+// Support for the unit tests run by unittests.sh. A failed CHECK is reported, after which the test
+// continues, such that a single run reports all failures. main should return unittest_result().
+
+#include <cstdio>
+
+static int unittest_failures;
+
+#define CHECK(_x)                                                             \
+  do {                                                                        \
+    if (!(_x)) {                                                              \
+      fprintf(stderr, "%s:%d: Check failed: %s\n", __FILE__, __LINE__, #_x); \
+      ++unittest_failures;                                                    \
+    }                                                                         \
+  } while (false)
+
+static inline int unittest_result() { return unittest_failures == 0 ? 0 : 1; }
+
+#endif
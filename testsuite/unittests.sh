@@ -0,0 +1,76 @@
+#!/bin/bash
+
+# Build and run the unit tests (the *_test.cc files in this directory). The unit tests check classes
+# which are internal to the library, and therefore not exported from the shared library. The tests
+# are linked against objects built from the library sources instead.
+
+DIR="`dirname \"$0\"`"
+. "$DIR"/_common.sh
+
+# Set SANITIZE to build with -fsanitize=$SANITIZE, for example SANITIZE=thread to check the tests
+# that use multiple threads. The objects are then built in a separate directory.
+
+# modified_xxhash_test.cc compares against the reference xxHash implementation, which is not part
+# of this repository. It is only built when named explicitly.
+if [ $# -eq 0 ] ; then
+	TESTS=`cd "$DIR" && ls *_test.cc | grep -v '^modified_xxhash_test\.cc$'`
+else
+	TESTS="$*"
+fi
+
+cd_workdir
+UNITTESTS="unittests${SANITIZE:+-$SANITIZE}"
+{ [ -d "$UNITTESTS" ] || mkdir "$UNITTESTS" ; } || fail "Could not create $UNITTESTS dir"
+cd "$UNITTESTS" || fail "Could not change to $UNITTESTS dir"
+
+SRCDIR=../../../src
+# The flags and libraries are those used for building the library, as written by its Makefile.
+# Relative include and library paths in them are relative to the source directory.
+make -s --no-print-directory -C "$SRCDIR" .unittest-opts || fail "!! Could not determine build flags"
+. "$SRCDIR"/.unittest-opts
+SRCPATH="`cd \"$SRCDIR\" && pwd`"
+absolute_paths() {
+	for FLAG in "$@" ; do
+		case "$FLAG" in
+			-[IL]/*) printf '%s ' "$FLAG" ;;
+			-[IL]*) printf '%s ' "${FLAG:0:2}$SRCPATH/${FLAG:2}" ;;
+			*) printf '%s ' "$FLAG" ;;
+		esac
+	done
+}
+CXXFLAGS="-g -Wall -I$SRCPATH `absolute_paths $CXXFLAGS` ${SANITIZE:+-fsanitize=$SANITIZE}"
+LDLIBS="`absolute_paths $LDLIBS`"
+# Run the tests with the libraries from the directories the library is linked against.
+for FLAG in $LDLIBS ; do
+	if [ "${FLAG#-L}" != "$FLAG" ] ; then
+		LDLIBS="$LDLIBS -Wl,-rpath=${FLAG#-L}"
+	fi
+done
+
+OBJECTS=
+for SOURCE in `cd "$SRCDIR" && ls *.cc */*.cc | grep -v '^x11\.cc$'` ; do
+	OBJECT="`echo \"$SOURCE\" | tr / _`"
+	OBJECT="${OBJECT%.cc}.o"
+	if [ ! -e "$OBJECT" ] || [ "$SRCDIR/$SOURCE" -nt "$OBJECT" ] ; then
+		g++ $CXXFLAGS -c "$SRCDIR/$SOURCE" -o "$OBJECT" || fail "!! Could not compile $SOURCE"
+	fi
+	OBJECTS="$OBJECTS $OBJECT"
+done
+
+failed=0
+total=0
+
+for TEST in $TESTS ; do
+	echo "=== Testing ${TEST%.cc} ===" >&2
+	total=$(( total + 1 ))
+	if ! g++ $CXXFLAGS "../../$TEST" $OBJECTS $LDLIBS -o "${TEST%.cc}" ; then
+		echo "!! Could not compile test" >&2
+		failed=$(( failed + 1 ))
+	elif ! "./${TEST%.cc}" ; then
+		echo "!! Test failed" >&2
+		failed=$(( failed + 1 ))
+	fi
+done
+
+echo "Tests run: $total, failed: $failed" >&2
+[ $failed -eq 0 ]
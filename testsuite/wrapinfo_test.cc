@@ -0,0 +1,353 @@
+/* Copyright (C) 2018 G.P. Halkes
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License version 3, as
+   published by the Free Software Foundation.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Test wrap_info_t against wrapping each line from scratch with text_line_t::find_next_break_pos.
+
+#include <algorithm>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+#include "t3widget/textbuffer.h"
+#include "t3widget/wrapinfo.h"
+#include "unittest.h"
+
+using namespace t3widget;
+
+static int wrap_width = 30;
+static int tabsize = 8;
+
+// Returns the start positions of the rows of @p line, as wrap_info_t should compute them.
+static std::vector<text_pos_t> reference_rows(const text_buffer_t &text, text_pos_t line) {
+  std::vector<text_pos_t> result(1, 0);
+  const text_line_t &text_line = text.get_line_data(line);
+  while (true) {
+    text_line_t::break_pos_t break_pos =
+        text_line.find_next_break_pos(result.back(), wrap_width - 1, tabsize);
+    if (break_pos.pos <= 0) {
+      return result;
+    }
+    result.push_back(break_pos.pos);
+  }
+}
+
+static std::string random_text(int lines) {
+  static const char *const words[] = {"a", "word", "longer_word", "\t", " ", "x"};
+  std::string result;
+  for (int i = 0; i < lines; ++i) {
+    if (i > 0) {
+      result += '\n';
+    }
+    const int length = std::rand() % 4 == 0 ? std::rand() % 60 : std::rand() % 15;
+    for (int j = 0; j < length; ++j) {
+      result += words[std::rand() % 6];
+    }
+  }
+  return result;
+}
+
+// Checks the number of rows of each line, and the conversions between lines and rows.
+static bool check_rows(const text_buffer_t &text, const wrap_info_t &wrap_info) {
+  text_pos_t rows = 0;
+  for (text_pos_t line = 0; line < text.size(); ++line) {
+    const text_pos_t line_rows = reference_rows(text, line).size();
+    if (wrap_info.get_line_count(line) != line_rows || wrap_info.get_rows_before(line) != rows) {
+      return false;
+    }
+    for (text_pos_t i = 0; i < line_rows; ++i) {
+      if (!(wrap_info.find_row(rows + i) == text_coordinate_t(line, i))) {
+        return false;
+      }
+    }
+    rows += line_rows;
+  }
+  return wrap_info.wrapped_size() == rows && wrap_info.get_rows_before(text.size()) == rows;
+}
+
+static void test_rows() {
+  text_buffer_t text;
+  text.append_text(random_text(3000));
+  wrap_info_t wrap_info(wrap_width, tabsize);
+  wrap_info.set_text_buffer(&text);
+  CHECK(check_rows(text, wrap_info));
+
+  for (int i = 0; i < 60; ++i) {
+    const text_pos_t line = std::rand() % text.size();
+    switch (i % 6) {
+      case 0:
+        text.set_cursor(text_coordinate_t(line, 0));
+        text.insert_block(random_text(1 + std::rand() % 50));
+        break;
+      case 1: {
+        const text_pos_t end = std::min(text.size() - 1, line + std::rand() % 100);
+        text.delete_block(text_coordinate_t(line, 0), text_coordinate_t(end, 0));
+        break;
+      }
+      case 2:
+        text.set_cursor(text_coordinate_t(line, 0));
+        for (int j = 0; j < 40; ++j) {
+          text.insert_char('y');
+        }
+        break;
+      case 3:
+        wrap_width = 10 + std::rand() % 60;
+        wrap_info.set_wrap_width(wrap_width);
+        break;
+      case 4:
+        tabsize = 1 + std::rand() % 8;
+        wrap_info.set_tabsize(tabsize);
+        break;
+      case 5:
+        text.set_cursor(text_coordinate_t(line, 0));
+        text.break_line();
+        break;
+    }
+    CHECK(check_rows(text, wrap_info));
+  }
+}
+
+// Checks that all positions of @p line are in the correct row.
+static bool check_breaks(const text_buffer_t &text, const wrap_info_t &wrap_info, text_pos_t line) {
+  const std::vector<text_pos_t> rows = reference_rows(text, line);
+  if (wrap_info.get_line_count(line) != static_cast<text_pos_t>(rows.size())) {
+    return false;
+  }
+  size_t row = 0;
+  for (text_pos_t pos = 0; pos <= text.get_line_size(line); ++pos) {
+    if (row + 1 < rows.size() && pos >= rows[row + 1]) {
+      ++row;
+    }
+    if (wrap_info.find_line(text_coordinate_t(line, pos)) != static_cast<text_pos_t>(row)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Edits within long lines are rewrapped from the edit onwards, and the rewrapping stops once the
+// break positions match the old ones. Spaces and tabs are typed as well as letters, such that
+// edits also move break positions before and after the edit.
+static void test_local_rewrap() {
+  static const key_t keys[] = {'a', 'b', ' ', ' ', '\t', 0xe9};
+  wrap_width = 25;
+  tabsize = 4;
+  text_buffer_t text;
+  std::string contents;
+  while (contents.size() < 2000) {
+    contents += random_text(1);
+  }
+  for (int i = 0; i < 5; ++i) {
+    text.append_text(contents.substr(i * 400, 400) + "\n");
+  }
+  wrap_info_t wrap_info(wrap_width, tabsize);
+  wrap_info.set_text_buffer(&text);
+
+  for (int i = 0; i < 3000; ++i) {
+    const text_pos_t line = std::rand() % text.size();
+    const string_view data = text.get_line_data(line).get_view();
+    text_pos_t pos = std::rand() % (data.size() + 1);
+    // Position the cursor at the start of a character.
+    while (pos < static_cast<text_pos_t>(data.size()) && (data[pos] & 0xc0) == 0x80) {
+      --pos;
+    }
+    text.set_cursor(text_coordinate_t(line, pos));
+    switch (std::rand() % 3) {
+      case 0:
+        text.insert_char(keys[std::rand() % 6]);
+        break;
+      case 1:
+        text.delete_char();
+        break;
+      case 2:
+        text.backspace_char();
+        break;
+    }
+    CHECK(check_breaks(text, wrap_info, line));
+  }
+  CHECK(check_rows(text, wrap_info));
+}
+
+static text_pos_t reference_size(const text_buffer_t &text) {
+  text_pos_t rows = 0;
+  for (text_pos_t line = 0; line < text.size(); ++line) {
+    rows += reference_rows(text, line).size();
+  }
+  return rows;
+}
+
+// Wraps the pending lines, as the main loop would, and returns the number of time slices needed.
+static int wrap_all_pending(wrap_info_t *wrap_info, const text_buffer_t &text) {
+  const text_pos_t rows = reference_size(text);
+  int slices = 0;
+  while (wrap_info->wrapped_size() != rows && slices < 10000) {
+    wrap_info->wrap_pending();
+    ++slices;
+  }
+  return slices;
+}
+
+// After changing the wrap width of a large text, the lines are wrapped in the background. Until
+// then each line counts as a single row, except for lines that have been accessed.
+static void test_lazy_rows() {
+  wrap_width = 30;
+  tabsize = 8;
+  text_buffer_t text;
+  text.append_text(random_text(20000));
+  wrap_info_t wrap_info(wrap_width, tabsize);
+  wrap_info.set_text_buffer(&text);
+  int rows_changed = 0;
+  wrap_info.connect_rows_changed([&] { ++rows_changed; });
+  wrap_all_pending(&wrap_info, text);
+  CHECK(check_rows(text, wrap_info));
+
+  for (int width : {20, 45, 12, 80}) {
+    wrap_width = width;
+    wrap_info.set_wrap_width(width);
+    CHECK(wrap_info.wrapped_size() == text.size());
+
+    // Accessing a line wraps only that line.
+    const text_pos_t line = std::rand() % text.size();
+    const text_pos_t line_rows = reference_rows(text, line).size();
+    CHECK(wrap_info.get_line_count(line) == line_rows);
+    CHECK(wrap_info.wrapped_size() == text.size() + line_rows - 1);
+
+    // Edits while lines are pending.
+    text.set_cursor(text_coordinate_t(line, 0));
+    text.insert_block(random_text(5));
+    text.delete_block(text_coordinate_t(line / 2, 0), text_coordinate_t(line / 2 + 10, 0));
+
+    rows_changed = 0;
+    CHECK(wrap_all_pending(&wrap_info, text) > 0);
+    CHECK(rows_changed > 0);
+    CHECK(check_rows(text, wrap_info));
+  }
+}
+
+// Lines that fit on a single row still do after increasing the wrap width, so only the lines with
+// multiple rows are wrapped again.
+static void test_widen() {
+  wrap_width = 40;
+  tabsize = 8;
+  text_buffer_t text;
+  for (int i = 0; i < 5000; ++i) {
+    text.append_text("short line " + std::to_string(i) + "\n");
+  }
+  wrap_info_t wrap_info(wrap_width, tabsize);
+  wrap_info.set_text_buffer(&text);
+  int rows_changed = 0;
+  wrap_info.connect_rows_changed([&] { ++rows_changed; });
+  wrap_all_pending(&wrap_info, text);
+  CHECK(check_rows(text, wrap_info));
+
+  // All lines fit on a single row, so no lines are left to wrap.
+  rows_changed = 0;
+  wrap_width = 60;
+  wrap_info.set_wrap_width(wrap_width);
+  wrap_info.wrap_pending();
+  CHECK(rows_changed == 0);
+  CHECK(check_rows(text, wrap_info));
+
+  // With a few long lines, only those are wrapped again.
+  for (int i = 0; i < 10; ++i) {
+    text.set_cursor(text_coordinate_t(i * 400, 0));
+    text.insert_block(std::string(200, 'x') + " " + std::string(200, 'y'));
+  }
+  CHECK(check_rows(text, wrap_info));
+  const text_pos_t rows = wrap_info.wrapped_size();
+  wrap_width = 100;
+  wrap_info.set_wrap_width(wrap_width);
+  CHECK(wrap_info.wrapped_size() == text.size());
+  CHECK(wrap_info.get_line_count(1) == 1);
+  CHECK(wrap_info.wrapped_size() == text.size());
+  rows_changed = 0;
+  CHECK(wrap_all_pending(&wrap_info, text) > 0);
+  CHECK(rows_changed > 0);
+  CHECK(wrap_info.wrapped_size() < rows);
+  CHECK(check_rows(text, wrap_info));
+}
+
+static bool equal(const wrap_data_t &data, const std::vector<std::vector<text_pos_t>> &model) {
+  if (data.size() != static_cast<text_pos_t>(model.size())) {
+    return false;
+  }
+  for (size_t line = 0; line < model.size(); ++line) {
+    if (data.rows(line) != static_cast<text_pos_t>(model[line].size())) {
+      return false;
+    }
+    for (size_t i = 0; i < model[line].size(); ++i) {
+      if (data.get(line, i) != model[line][i]) {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+// Replaces the break positions of @p line from index @p keep onwards, in @p data and @p model.
+static void set_breaks(wrap_data_t *data, std::vector<std::vector<text_pos_t>> *model,
+                       text_pos_t line, text_pos_t keep, text_pos_t base) {
+  std::vector<text_pos_t> &breaks = (*model)[line];
+  breaks.resize(keep);
+  std::vector<text_pos_t> new_breaks;
+  for (int i = std::rand() % 20; i > 0; --i) {
+    new_breaks.push_back(breaks.back() + base + 1 + std::rand() % 100);
+    breaks.push_back(new_breaks.back());
+  }
+  data->set_breaks(line, keep, new_breaks.data(), new_breaks.size());
+}
+
+// The break positions are stored as 32-bit values until a break position does not fit. All stored
+// positions must be kept when switching to 64-bit values, also for lines that are edited later.
+static void test_wide_breaks() {
+  wrap_data_t data;
+  std::vector<std::vector<text_pos_t>> model;
+  data.insert_lines(0, 3000);
+  model.resize(3000, std::vector<text_pos_t>(1, 0));
+
+  const text_pos_t wide_base = text_pos_t(1) << 32;
+  for (int i = 0; i < 20000; ++i) {
+    const text_pos_t line = std::rand() % model.size();
+    const text_pos_t keep = 1 + std::rand() % model[line].size();
+    // Large positions only start appearing halfway, and some are just below the 32-bit limit.
+    text_pos_t base = 0;
+    if (i == 10000) {
+      base = wide_base;
+    } else if (i > 10000 && std::rand() % 4 == 0) {
+      base = std::rand() % 2 == 0 ? wide_base : wide_base - 2000;
+    }
+    set_breaks(&data, &model, line, keep, base);
+
+    if (i % 1000 == 999) {
+      const text_pos_t first = std::rand() % model.size();
+      const text_pos_t last = std::min<text_pos_t>(model.size(), first + std::rand() % 200);
+      data.erase_lines(first, last);
+      model.erase(model.begin() + first, model.begin() + last);
+      data.insert_lines(first, 150);
+      model.insert(model.begin() + first, 150, std::vector<text_pos_t>(1, 0));
+    }
+    if (i == 9999 || i == 10000 || i % 5000 == 4999) {
+      CHECK(equal(data, model));
+    }
+  }
+  CHECK(equal(data, model));
+}
+
+int main(int, char **) {
+  test_rows();
+  test_local_rewrap();
+  test_lazy_rows();
+  test_widen();
+  test_wide_breaks();
+  return unittest_result();
+}